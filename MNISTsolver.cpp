@@ -6,9 +6,13 @@
 #include <cstring>
 #include <time.h>
 #include <filesystem>
+#include <atomic>
 
 #include "cake/func/randoms.hpp"
 #include "cake/func/fft.hpp"
+#include "cake/func/parallel.hpp"
+#include "cake/func/spectrum-cache.hpp"
+#include "cake/func/tuning-cache.hpp"
 
 #include "cake/cake-reversible.hpp"
 
@@ -24,6 +28,8 @@
 #include "cake/layer/BSC1dx-matrix.hpp"
 #include "cake/layer/convolution.hpp"
 #include "cake/layer/sparse-convolution.hpp"
+#include "cake/layer/convolution-2d.hpp"
+#include "cake/layer/local-convolution.hpp"
 
 using std::cin;
 using std::cout;
@@ -53,6 +59,14 @@ class TrainProtocol{
 
 		ReversibleCake<float> *trainee = NULL;
 		vector<pair<vector<uint8_t>, int32_t> > train_data, test_data;
+
+		// training batches are split between this many threads.
+		// Thread 0 uses the trainee, the others their own replicas of it.
+		int32_t threads = std::max(1, (int32_t)std::thread::hardware_concurrency());
+		vector<ReversibleCake<float>*> replicas;
+
+		// the input spectra of the images for the first layer, see cache_spectra.
+		SpectrumCache<float> train_spectra, test_spectra;
 		
 		TrainProtocol(){
 			train_size = 0;
@@ -70,6 +84,26 @@ class TrainProtocol{
 			data_from_file(filepath);
 		}
 
+		~TrainProtocol(){
+			clear_replicas();
+		}
+
+		// the replicas must be remade whenever the trainee changes.
+		void set_trainee(ReversibleCake<float> *trainee_){
+			trainee = trainee_;
+			clear_replicas();
+		}
+
+		void clear_replicas(){
+			for(auto i : replicas) delete i;
+			replicas.clear();
+		}
+
+		ReversibleCake<float> *worker_cake(int32_t worker){
+			if(worker == 0) return trainee;
+			return replicas[worker-1];
+		}
+
 		void data_from_file(string filepath){
 
 			ifstream header_in(filepath);
@@ -80,6 +114,9 @@ class TrainProtocol{
 			}
 			
 			string training_images, training_labels, test_images, test_labels;
+
+			train_spectra.clear();
+			test_spectra.clear();
 			
 			header_in >> training_images >> training_labels;
 			header_in >> test_images >> test_labels;
@@ -167,22 +204,84 @@ class TrainProtocol{
 			return ret;
 		}
 		
-		void train_batch(int32_t size){
-		
-			trainee->zero_changes();
+		/*
+		   The images never change, so if the first layer works on
+		   FFTs, their spectra can be made once here instead of for
+		   every use. Half precision takes half the memory. The caches
+		   are only used while they fit the first layer, making them
+		   again after the cake changes is up to the user.
+		*/
+		bool cache_spectra(bool half){
+
+			int32_t size = trainee->input_transform_size();
+			if(size == 0) return 0;
+
+			auto image_fill = [&](vector<pair<vector<uint8_t>, int32_t> > &data){
+				return [&data](int32_t i, float *x){
+					for(int32_t j=0; j<(int32_t)data[i].first.size(); j++) x[j] = (float)((int32_t)data[i].first[j]);
+				};
+			};
+
+			train_spectra.build(fft, size, train_size, image_size, image_fill(train_data), half);
+			test_spectra.build(fft, size, test_size, image_size, image_fill(test_data), half);
+			return 1;
+		}
 
-			for(int32_t i=0; i<size; i++){
-				int32_t sample = rand()%train_size;
+		void clear_spectra(){
+			train_spectra.clear();
+			test_spectra.clear();
+		}
 
-				vector<float> feedback = trainee->process(tofloat(train_data[sample].first));
-				
-				for(float &i : feedback) i = -i;
+		// runs the samples through cake and accumulates the changes.
+		void evaluate_samples(ReversibleCake<float> *cake, int32_t *samples, int32_t size){
 
-				feedback[train_data[sample].second] += 1.0;
+			DenseMatrix<float> images(size, image_size);
 
-				trainee->evaluate(feedback);
+			for(int32_t i=0; i<size; i++){
+				vector<uint8_t> &image = train_data[samples[i]].first;
+				for(int32_t j=0; j<image_size; j++) images(i, j) = (float)((int32_t)image[j]);
+			}
+
+			cake->use_input_spectra(&train_spectra, Span<const int32_t>(samples, size));
+			DenseMatrix<float> feedback = cake->process_batch(images);
+
+			for(int32_t i=0; i<size; i++){
+				for(int32_t j=0; j<feedback.get_cols(); j++) feedback(i, j) = -feedback(i, j);
+				feedback(i, train_data[samples[i]].second) += 1.0;
 			}
 
+			cake->evaluate_batch(feedback);
+			cake->use_input_spectra(NULL, {});
+		}
+		
+		void train_batch(int32_t size){
+
+			vector<int32_t> samples(size);
+			for(int32_t i=0; i<size; i++) samples[i] = rand()%train_size;
+
+			/*
+			   Data-parallel training: the batch is split between
+			   the workers, each one runs its part through its own
+			   cake. The replicas take the trainee's variables
+			   first, and afterwards the changes of all workers
+			   are added together into the trainee.
+			*/
+
+			int32_t workers = std::max(1, std::min(threads, size));
+			while((int32_t)replicas.size() < workers-1) replicas.push_back(trainee->replicate());
+
+			parallel::run(workers, [&](int32_t worker){
+				ReversibleCake<float> *cake = worker_cake(worker);
+				if(worker) cake->copy_variables(trainee);
+				cake->zero_changes();
+				int32_t begin = worker*size/workers, end = (worker+1)*size/workers;
+				evaluate_samples(cake, samples.data()+begin, end-begin);
+			});
+
+			parallel::tree_reduce(workers, [&](int32_t a, int32_t b){
+				worker_cake(a)->add_changes(worker_cake(b));
+			});
+
 			trainee->downscale_changes((float)size);
 			trainee->adjust();
 
@@ -194,27 +293,111 @@ class TrainProtocol{
 			}
 		}
 
+		void train_async(int32_t amount, int32_t size){
+
+			/*
+			   Asynchronous (Hogwild-style) training: the workers take
+			   batches from a shared counter and never wait for each other.
+			   For each batch a worker refreshes its replica from the
+			   trainee, accumulates the changes and adds them straight
+			   to the trainee's variables.
+
+			   The reads & writes of the trainee's variables are
+			   deliberately not synchronized. A worker may see another
+			   one's update half done, or two updates may overlap and
+			   one gets lost. Since the changes of one batch are small,
+			   this costs little accuracy and removes the barrier
+			   between batches. Worker 0 trains the trainee directly.
+			*/
+
+			vector<int32_t> samples((size_t)amount*size);
+			for(int32_t &i : samples) i = rand()%train_size;
+
+			int32_t workers = std::max(1, std::min(threads, amount));
+			while((int32_t)replicas.size() < workers-1) replicas.push_back(trainee->replicate());
+
+			std::atomic<int32_t> next(0);
+
+			parallel::run(workers, [&](int32_t worker){
+				ReversibleCake<float> *cake = worker_cake(worker);
+				for(int32_t batch=next++; batch<amount; batch=next++){
+					if(worker) cake->copy_variables(trainee);
+					cake->zero_changes();
+					evaluate_samples(cake, samples.data()+(size_t)batch*size, size);
+					cake->downscale_changes((float)size);
+					if(worker) cake->push_changes(trainee);
+					else cake->adjust();
+				}
+			});
+		}
 
-		int32_t test(){
+
+		// the number of test images in [start, start+size) cake classifies right.
+		int32_t test_chunk(ReversibleCake<float> *cake, int32_t start, int32_t size){
 
 			int32_t score = 0;
 
-			for(int32_t i=0; i<test_size; i++){
-				vector<float> result = trainee->process(tofloat(test_data[i].first));
+			DenseMatrix<float> images(size, image_size);
+			for(int32_t i=0; i<size; i++){
+				vector<uint8_t> &image = test_data[start+i].first;
+				for(int32_t j=0; j<image_size; j++) images(i, j) = (float)((int32_t)image[j]);
+			}
+
+			vector<int32_t> samples(size);
+			for(int32_t i=0; i<size; i++) samples[i] = start+i;
+
+			cake->use_input_spectra(&test_spectra, samples);
+			const DenseMatrix<float> &result = cake->process_batch(images);
+			cake->use_input_spectra(NULL, {});
+
+			for(int32_t i=0; i<size; i++){
 				int32_t ans = 0;
 				float max = -1e9;
 				for(int32_t j=0; j<10; j++){
-					if(max < result[j]){
+					if(max < result(i, j)){
 						ans = j;
-						max = result[j];
+						max = result(i, j);
 					}
 				}
-				if(ans == test_data[i].second) score++;
+				if(ans == test_data[start+i].second) score++;
 			}
 
 			return score;
 		}
 
+		int32_t test(){
+
+			/*
+			   The test set is cut into chunks that the workers
+			   take in turns, each worker with its own cake, so
+			   no two threads use the same layer values. Every chunk
+			   has its own score slot, so the total doesn't depend
+			   on which worker did which chunk.
+			*/
+
+			const int32_t chunk = 256;
+			int32_t chunks = (test_size+chunk-1)/chunk;
+
+			int32_t workers = std::max(1, std::min(threads, chunks));
+			while((int32_t)replicas.size() < workers-1) replicas.push_back(trainee->replicate());
+
+			vector<int32_t> scores(chunks, 0);
+			std::atomic<int32_t> next(0);
+
+			parallel::run(workers, [&](int32_t worker){
+				ReversibleCake<float> *cake = worker_cake(worker);
+				if(worker) cake->copy_variables(trainee);
+				for(int32_t c=next++; c<chunks; c=next++){
+					scores[c] = test_chunk(cake, c*chunk, std::min(chunk, test_size-c*chunk));
+				}
+			});
+
+			int32_t score = 0;
+			for(int32_t i : scores) score += i;
+
+			return score;
+		}
+
 		void train_program(string name, int32_t amount, int32_t size){
 			
 
@@ -241,6 +424,7 @@ class TrainProtocol{
 					trainee->write_file(prevBest);
 				} else {
 					read_mnist_cake(prevBest, trainee);
+					set_trainee(trainee);
 					solution = trainee;
 				}
 
@@ -310,8 +494,15 @@ void read_mnist_cake(string filename, ReversibleCake<float>* &cake){
 				layer = new ConvolutionLayer<float>(get_in, fft);
 				break;
 			case SPARSE_CONVOLUTION_LAYER_ID:
+			case SPARSE_CONVOLUTION_LAYER_V1_ID:
 				layer = new SparseConvolutionLayer<float>(get_in, fft);
 				break;
+			case CONVOLUTION_2D_LAYER_ID:
+				layer = new Convolution2DLayer<float>(get_in, fft);
+				break;
+			case LOCAL_CONVOLUTION_LAYER_ID:
+				layer = new LocalConvolutionLayer<float>(get_in);
+				break;
 		}
 
 		if(layer != NULL) cake->add_layer(layer);
@@ -350,12 +541,39 @@ int main(){
 
 		} else if(inst == "train"){
 
+			// an optional mode comes first: train [sync/async] amount size
+			string mode;
 			int32_t amount, size;
-			cin >> amount >> size;
+			cin >> mode;
+			if(mode == "sync" || mode == "async") cin >> amount;
+			else amount = std::atoi(mode.c_str());
+			cin >> size;
+
+			if(mode == "async") protocol.train_async(amount, size);
+			else protocol.train_batches(amount, size);
+
+			cout << "done\n";
+		} else if(inst == "threads"){
+
+			cin >> protocol.threads;
+			protocol.threads = std::max(1, protocol.threads);
+			parallel::set_thread_count(protocol.threads);
+
+			cout << "done\n";
 
-			protocol.train_batches(amount, size);
+		} else if(inst == "spectra"){
+
+			string mode;
+			cin >> mode;
+
+			if(mode == "off") protocol.clear_spectra();
+			else if(!protocol.cache_spectra(mode == "half")){
+				cout << "the first layer doesn't use FFTs\n";
+				continue;
+			}
 
 			cout << "done\n";
+
 		} else if(inst == "program"){
 
 			string name;
@@ -370,6 +588,20 @@ int main(){
 
 			cout << protocol.test() << '\n';
 
+		} else if(inst == "tune"){
+
+			// picks the layer implementations for training batches of
+			// this size, the shapes tuning.ckt doesn't have yet are
+			// measured. A loaded cake starts untuned, tune it again.
+			int32_t size;
+			cin >> size;
+
+			TuningCache tuning("tuning.ckt", size);
+			solution->autotune(tuning);
+			protocol.set_trainee(solution);
+
+			cout << "done\n";
+
 		} else if(inst == "config"){
 
 			cin >> inst;
@@ -392,7 +624,7 @@ int main(){
 			cin >> filename;
 
 			read_mnist_cake("saves/"+filename, solution);
-			protocol.trainee = solution;
+			protocol.set_trainee(solution);
 
 			cout << "done\n";
 
@@ -401,7 +633,10 @@ int main(){
 			cout
 				<< "\nsupported commands are:\n"
 				<< "data filename(string)\n"
-				<< "train amount(int) batch_size(int)\n"
+				<< "train [sync/async] amount(int) batch_size(int)\n"
+				<< "threads count(int)\n"
+				<< "spectra float/half/off\n"
+				<< "tune batch_size(int)\n"
 				<< "test\n"
 				<< "config in/out\n"
 				<< "save filename(string)\n"
@@ -6,6 +6,9 @@
 
 #include "layer/base.hpp"
 #include "layer/base-reversible.hpp"
+#include "func/parallel.hpp"
+#include "func/spsc-queue.hpp"
+#include "func/tuning-cache.hpp"
 
 using std::vector;
 using std::string;
@@ -55,10 +58,110 @@ template<class T> class ReversibleCake{
 			this->n++;
 		}
 
-		// 2. connect the layers to a cake.
-		void connect_layers(){
+		// 2. connect the layers to a cake. Only with a tuning cache
+		// are they also tuned, which takes measuring and writes
+		// the cache's file, see autotune.
+		void connect_layers(TuningCache *tuning = NULL){
 			for(int32_t i=0; i<n-1; i++) this->layer[i]->connect_next(this->layer[i+1]->n);
 			this->layer[n-1]->connect_next(this->layer[n-1]->n);
+			if(tuning) this->autotune(*tuning);
+		}
+
+		/*
+		   Picks the fastest implementation for every layer that
+		   has more than one. A layer shape that's in the tuning
+		   cache for this machine takes the stored one, the others
+		   are measured: a copy of the layer runs a batch of the
+		   cache's batch size forward & back in each of its ways.
+		   New results are saved to the cache file.
+		*/
+		void autotune(TuningCache &tuning){
+
+			for(int32_t i=0; i<n; i++){
+
+				ReversibleLayer<T> *l = this->layer[i];
+				if(l->implementations() < 2) continue;
+
+				string shape = l->shape_key();
+				int32_t k = tuning.find(shape);
+
+				if(k < 0 || k >= l->implementations()){
+					k = this->measure(l, this->layer[std::min(i+1, n-1)]->n, tuning);
+					tuning.store(shape, k);
+				}
+				l->use_implementation(k);
+			}
+
+			tuning.save();
+		}
+
+		// the fastest implementation of l (m outputs), its variables and changes are left alone.
+		int32_t measure(ReversibleLayer<T> *l, int32_t m, const TuningCache &tuning){
+
+			int32_t batch = tuning.batch_size();
+
+			ReversibleLayer<T> *copy = l->clone();
+			Layer<T> next(m, this->zero);
+			DenseMatrix<T> feedback(batch, m);
+
+			copy->set_batch_size(batch);
+			next.set_batch_size(batch);
+
+			// made up values, std::rand is left alone so that seeded
+			// runs go the same whether the cache had the shape or not.
+			uint32_t seed = 1;
+			auto value = [&]{
+				seed = seed*1103515245u+12345u;
+				return (T)((int32_t)(seed>>16&0x7fff)-0x4000)/(T)0x4000;
+			};
+			for(int32_t b=0; b<batch; b++){
+				for(int32_t j=0; j<l->n; j++) copy->bv(b, j) = value();
+				for(int32_t j=0; j<m; j++) feedback(b, j) = value();
+			}
+
+			int32_t fastest = 0;
+			double best = 0;
+			for(int32_t k=0; k<copy->implementations(); k++){
+				copy->use_implementation(k);
+				double t = tuning.time([&]{
+					copy->project_next_batch(&next);
+					copy->evaluate_batch(feedback);
+				});
+				if(k == 0 || t < best){
+					best = t;
+					fastest = k;
+				}
+			}
+
+			delete copy;
+			return fastest;
+		}
+
+		/*
+		   For running the cake on many threads at once:
+		   replicate makes a new cake with copies of the layers,
+		   so that it has its own data & changes. copy_variables
+		   takes the variables of a replica (or the original) and
+		   add_changes adds up the accumulated changes.
+		   push_changes adjusts the variables of target with
+		   the changes of this cake.
+		*/
+		ReversibleCake<T> *replicate(){
+			ReversibleCake<T> *copy = new ReversibleCake<T>(this->zero);
+			for(auto i : this->layer) copy->add_layer(i->clone());
+			return copy;
+		}
+
+		void copy_variables(ReversibleCake<T> *other){
+			for(int32_t i=0; i<n; i++) this->layer[i]->copy_variables(other->layer[i]);
+		}
+
+		void add_changes(ReversibleCake<T> *other){
+			for(int32_t i=0; i<n; i++) this->layer[i]->add_changes(other->layer[i]);
+		}
+
+		void push_changes(ReversibleCake<T> *target){
+			for(int32_t i=0; i<n; i++) this->layer[i]->push_changes(target->layer[i]);
 		}
 
 		// randomize the variables used in the layers, varible = random_func().
@@ -98,23 +201,149 @@ template<class T> class ReversibleCake{
 			for(auto i : this->layer) i->downscale_changes(down);
 		}
 
-		// Runs the input data through the cake.
-		vector<T> process(const vector<T> data_in){
+		// Runs the input data through the cake. The result is
+		// a view of the last layer, valid until the next run.
+		Span<const T> process(Span<const T> data_in){
 			this->layer[0]->set_vector_values(data_in);	
 			for(int32_t i=0; i<n-1; i++) this->layer[i]->project_next(this->layer[i+1]);
 			this->layer[n-1]->project_next(this->layer[n-1]);
 			return this->layer[n-1]->get_vector();
 		}
 
+		/*
+		   Runs a batch of inputs through the cake, one input
+		   per row of data_in (row-major, layer[0]->n columns).
+		   Row b of the result is what process would return
+		   for row b of the input.
+
+		   Running a batch at once lets the matrix layers
+		   read their matrices once per batch instead of once per input.
+		*/
+		const DenseMatrix<T> &process_batch(const DenseMatrix<T> &data_in){
+			for(auto i : this->layer) i->set_batch_size(data_in.get_rows());
+			this->layer[0]->set_batch_values(data_in);
+			for(int32_t i=0; i<n-1; i++) this->layer[i]->project_next_batch(this->layer[i+1]);
+			this->layer[n-1]->project_next_batch(this->layer[n-1]);
+			return this->layer[n-1]->bv;
+		}
+
+		/*
+		   Pipeline-parallel process for a stream of inputs:
+		   data_out[t] is what process(data_in[t]) would return.
+
+		   The layers are split into stages of consecutive layers
+		   with about equal work, each stage runs on its own thread.
+		   While stage s works on input t, stage s+1 works on t-1
+		   and so on. The last layer of a stage projects into a
+		   buffer that goes to the next stage through a lock-free
+		   queue of 2 buffers, so each stage boundary is double
+		   buffered and the next stage's layer values are never
+		   written by anyone else.
+
+		   This is for inference, the evaluate step would need the
+		   values of every layer for every input still in the pipeline.
+		*/
+		void process_stream(const vector<vector<T> > &data_in, vector<vector<T> > &data_out, int32_t stages){
+
+			int32_t count = data_in.size();
+			data_out.resize(count);
+			stages = std::max(1, std::min(stages, n));
+
+			vector<int32_t> first = this->split_stages(stages);
+
+			vector<Layer<T>*> boundary(stages-1);
+			vector<SpscQueue<vector<T> >*> queue(stages-1);
+			for(int32_t s=0; s<stages-1; s++){
+				int32_t size = this->layer[first[s+1]]->n;
+				boundary[s] = new Layer<T>(size, this->zero);
+				queue[s] = new SpscQueue<vector<T> >(2, vector<T>(size, this->zero));
+			}
+
+			parallel::concurrent(stages, [&](int32_t s){
+				int32_t a = first[s], b = first[s+1];
+				for(int32_t t=0; t<count; t++){
+
+					if(s == 0) this->layer[a]->set_vector_values(data_in[t]);
+					else queue[s-1]->pop(this->layer[a]->v);
+
+					for(int32_t i=a; i<b-1; i++) this->layer[i]->project_next(this->layer[i+1]);
+
+					if(b == n){
+						this->layer[n-1]->project_next(this->layer[n-1]);
+						data_out[t] = this->layer[n-1]->v;
+					} else {
+						this->layer[b-1]->project_next(boundary[s]);
+						queue[s]->push(boundary[s]->v);
+					}
+				}
+			});
+
+			for(auto i : boundary) delete i;
+			for(auto i : queue) delete i;
+		}
+
+		// first[s] is the first layer of stage s, first[stages] = n.
+		// The work of a layer is estimated as its size times the size of the next one.
+		vector<int32_t> split_stages(int32_t stages){
+
+			vector<double> work(n);
+			double total = 0;
+			for(int32_t i=0; i<n; i++){
+				work[i] = (double)this->layer[i]->n*this->layer[std::min(i+1, n-1)]->n;
+				total += work[i];
+			}
+
+			vector<int32_t> first = {0};
+			double sum = 0;
+			for(int32_t i=0; i<n; i++){
+				int32_t s = first.size();
+				// cut before i if the stage is full, or if the rest of
+				// the layers are needed for one stage each.
+				if(s < stages && i > first.back()){
+					if(sum >= total*s/stages || n-i == stages-s) first.push_back(i);
+				}
+				sum += work[i];
+			}
+			first.push_back(n);
+
+			return first;
+		}
+
 		// Evaluates how successfull the last process run was
 		// and accumulates the desired changes
-		void evaluate(vector<T> &feedback){
+		void evaluate(Span<const T> feedback){
 			this->layer[n-1]->evaluate(feedback);
 			for(int32_t i=n-2; i>=0; i--){
 				this->layer[i]->evaluate(this->layer[i+1]->get_vector_changes());
 			}
 		}
 
+		// see ReversibleLayer::use_input_spectra, for the first layer.
+		int32_t input_transform_size(){
+			return this->layer[0]->input_transform_size();
+		}
+
+		void use_input_spectra(const SpectrumCache<T> *cache, Span<const int32_t> samples){
+			this->layer[0]->use_input_spectra(cache, samples);
+		}
+
+		/*
+		   The batch version of evaluate, for the batch that last went
+		   through process_batch. Row b of feedback is the feedback for
+		   row b of that batch. The changes of all rows are accumulated,
+		   the same as calling evaluate for each row in turn.
+
+		   The matrix layers take in the whole batch at once, so
+		   each change matrix is updated once per batch instead
+		   of once per row.
+		*/
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+			this->layer[n-1]->evaluate_batch(feedback);
+			for(int32_t i=n-2; i>=0; i--){
+				this->layer[i]->evaluate_batch(this->layer[i+1]->get_batch_changes());
+			}
+		}
+
 		// apply the desired changes
 		void adjust(){
 			for(auto i : this->layer) i->adjust();
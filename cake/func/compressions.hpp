@@ -9,7 +9,13 @@ using std::vector;
 
 namespace compress{
 	
-	template<class T> void div_x(vector<T> &v, vector<T> &dv, vector<T> c){
+	/*
+	   Every compression comes in two forms: one for a whole vector
+	   and one for n values behind a pointer, so that rows of
+	   a batch matrix can be compressed in place.
+	*/
+
+	template<class T> void div_x(T *v, T *dv, int32_t n, const vector<T> &c){
 
 		/*
 		   values get compressed to range [0, 1].
@@ -18,8 +24,6 @@ namespace compress{
 		   of the compression function is stored in dv.
 		*/
 
-		int32_t n = v.size();
-
 		for(int32_t i=0; i<n; i++){
 			v[i] *= c[0];
 			if(v[i] > (T)0){
@@ -34,11 +38,13 @@ namespace compress{
 		}
 	}
 	
-	template<class T> void div_xp2(vector<T> &v, vector<T> &dv, vector<T> c){
+	template<class T> void div_x(vector<T> &v, vector<T> &dv, vector<T> c){
+		div_x<T>(v.data(), dv.data(), (int32_t)v.size(), c);
+	}
 
-		// same idea as div_x, but the compression function is different
+	template<class T> void div_xp2(T *v, T *dv, int32_t n, const vector<T> &c){
 
-		int32_t n = v.size();
+		// same idea as div_x, but the compression function is different
 
 		for(int32_t i=0; i<n; i++){
 			v[i] *= c[0];
@@ -54,11 +60,13 @@ namespace compress{
 		}
 	}
 	
-	template<class T> void logistic(vector<T> &v, vector<T> &dv, vector<T> c){
+	template<class T> void div_xp2(vector<T> &v, vector<T> &dv, vector<T> c){
+		div_xp2<T>(v.data(), dv.data(), (int32_t)v.size(), c);
+	}
 
-		// Values get compressed to range [0, 1] with a logistic curve.
+	template<class T> void logistic(T *v, T *dv, int32_t n, const vector<T> &c){
 
-		int32_t n = v.size();
+		// Values get compressed to range [0, 1] with a logistic curve.
 
 		for(int32_t i=0; i<n; i++){
 			v[i] = std::exp(-c[0]*v[i]);
@@ -68,6 +76,10 @@ namespace compress{
 		}
 	}
 
+	template<class T> void logistic(vector<T> &v, vector<T> &dv, vector<T> c){
+		logistic<T>(v.data(), dv.data(), (int32_t)v.size(), c);
+	}
+
 	
 
 }
@@ -0,0 +1,219 @@
+#ifndef DENSE_MATRIX_HPP_
+#define DENSE_MATRIX_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+
+#include "kernels.hpp"
+#include "gemm.hpp"
+#include "parallel.hpp"
+
+using std::vector;
+
+const int32_t DENSE_MATRIX_ALIGN = 64;
+
+template<class T> class AlignedAllocator{
+
+	/*
+	   std::allocator, but every allocation starts on a
+	   DENSE_MATRIX_ALIGN (cache line) boundary.
+	*/
+
+	public:
+
+		typedef T value_type;
+
+		template<class U> struct rebind{ typedef AlignedAllocator<U> other; };
+
+		AlignedAllocator(){}
+		template<class U> AlignedAllocator(const AlignedAllocator<U>&){}
+
+		T *allocate(size_t n){
+			return (T*)::operator new(n*sizeof(T), std::align_val_t(DENSE_MATRIX_ALIGN));
+		}
+
+		void deallocate(T *p, size_t){
+			::operator delete(p, std::align_val_t(DENSE_MATRIX_ALIGN));
+		}
+
+		template<class U> bool operator==(const AlignedAllocator<U>&) const { return 1; }
+		template<class U> bool operator!=(const AlignedAllocator<U>&) const { return 0; }
+};
+
+template<class T> using aligned_vector = vector<T, AlignedAllocator<T> >;
+
+enum MatrixLayout{
+	ROW_MAJOR = 0,
+	COLUMN_MAJOR = 1
+};
+
+template<class T> class DenseMatrix{
+
+	/*
+	   A rows x cols matrix stored in one aligned buffer.
+
+	   The matrix is made of "lines": rows in the row-major
+	   layout, columns in the column-major layout. Each line
+	   is contiguous and starts on a cache line boundary,
+	   consecutive lines are ld (leading dimension) elements apart.
+	   Element (i, j) lives at:
+
+	   row-major:    data[i*ld+j]
+	   column-major: data[j*ld+i]
+
+	   The arithmetic functions below are the operations
+	   the matrix layers need. The single vector ones run on
+	   the vector kernels in func/kernels, the inner loop always
+	   along a line. Large ones are split between threads with
+	   parallel::split, each thread writing a separate slice
+	   of the output.
+	*/
+
+	protected:
+
+		int32_t rows = 0, cols = 0, ld = 0;
+		MatrixLayout layout = ROW_MAJOR;
+		aligned_vector<T> data;
+
+		static int32_t padded(int32_t len){
+			int32_t step = std::max<int32_t>(1, DENSE_MATRIX_ALIGN/(int32_t)sizeof(T));
+			return (len+step-1)/step*step;
+		}
+
+	public:
+
+		DenseMatrix(){}
+
+		DenseMatrix(int32_t rows_, int32_t cols_, T val = (T)0, MatrixLayout layout_ = ROW_MAJOR){
+			this->layout = layout_;
+			this->resize(rows_, cols_, val);
+		}
+
+		// the contents are kept if the shape doesn't change.
+		void resize(int32_t rows_, int32_t cols_, T val = (T)0){
+			if(rows_ == rows && cols_ == cols && !data.empty()) return;
+			rows = rows_;
+			cols = cols_;
+			ld = padded(layout == ROW_MAJOR ? cols : rows);
+			data.assign((size_t)ld*(layout == ROW_MAJOR ? rows : cols), val);
+		}
+
+		// re-packs the contents in the new layout.
+		void set_layout(MatrixLayout layout_){
+
+			if(layout_ == layout) return;
+
+			DenseMatrix<T> tmp(rows, cols, (T)0, layout_);
+			for(int32_t i=0; i<rows; i++){
+				for(int32_t j=0; j<cols; j++) tmp(i, j) = (*this)(i, j);
+			}
+			*this = tmp;
+		}
+
+		int32_t get_rows() const { return rows; }
+		int32_t get_cols() const { return cols; }
+		int32_t stride() const { return ld; }
+		MatrixLayout get_layout() const { return layout; }
+
+		int32_t lines() const { return layout == ROW_MAJOR ? rows : cols; }
+		int32_t line_size() const { return layout == ROW_MAJOR ? cols : rows; }
+
+		T *line(int32_t k){ return data.data()+(size_t)k*ld; }
+		const T *line(int32_t k) const { return data.data()+(size_t)k*ld; }
+
+		T &operator()(int32_t i, int32_t j){
+			if(layout == ROW_MAJOR) return data[(size_t)i*ld+j];
+			return data[(size_t)j*ld+i];
+		}
+
+		const T &operator()(int32_t i, int32_t j) const {
+			if(layout == ROW_MAJOR) return data[(size_t)i*ld+j];
+			return data[(size_t)j*ld+i];
+		}
+
+		void fill(T val){
+			for(int32_t k=0; k<this->lines(); k++){
+				T *l = this->line(k);
+				for(int32_t x=0; x<this->line_size(); x++) l[x] = val;
+			}
+		}
+
+		void divide(T down){
+			for(int32_t k=0; k<this->lines(); k++){
+				T *l = this->line(k);
+				for(int32_t x=0; x<this->line_size(); x++) l[x] /= down;
+			}
+		}
+
+		// this += a*other, the shapes and layouts must match.
+		void add_scaled(const DenseMatrix<T> &other, T a){
+			for(int32_t k=0; k<this->lines(); k++){
+				kernels::axpy<T>(this->line_size(), a, other.line(k), this->line(k));
+			}
+		}
+
+		// y[j] += sum_i this(i, j)*x[i], split by j.
+		void project(const T *x, T *y) const {
+			parallel::split(cols, (int64_t)rows*cols, [&](int32_t a, int32_t b){
+				if(layout == ROW_MAJOR) kernels::gemv<T>(rows, b-a, this->line(0)+a, ld, x, y+a);
+				else kernels::gemv_t<T>(b-a, rows, this->line(a), ld, x, y+a);
+			});
+		}
+
+		// x[i] += sum_j this(i, j)*y[j], split by i.
+		void project_back(const T *y, T *x) const {
+			parallel::split(rows, (int64_t)rows*cols, [&](int32_t a, int32_t b){
+				if(layout == ROW_MAJOR) kernels::gemv_t<T>(b-a, cols, this->line(a), ld, y, x+a);
+				else kernels::gemv<T>(cols, b-a, this->line(0)+a, ld, y, x+a);
+			});
+		}
+
+		// this(i, j) += x[i]*y[j], split by lines.
+		void add_outer(const T *x, const T *y){
+			parallel::split(this->lines(), (int64_t)rows*cols, [&](int32_t a, int32_t b){
+				if(layout == ROW_MAJOR) kernels::ger<T>(b-a, cols, this->line(a), ld, (T)1, x+a, y);
+				else kernels::ger<T>(b-a, rows, this->line(a), ld, (T)1, y+a, x);
+			}, 1);
+		}
+
+		/*
+		   The batch products. The batches are row-major matrices
+		   with one sample per row, the products run on the
+		   blocked GEMM in func/gemm. A column-major matrix is
+		   the row-major transpose, so it's the same product with
+		   the transpose flag of the matrix flipped.
+		*/
+
+		// out(b, j) += sum_i this(i, j)*in(b, i), project for every row.
+		void project_batch(const DenseMatrix<T> &in, DenseMatrix<T> &out) const {
+			gemm::gemm<T>(
+				gemm::NO_TRANS, layout == ROW_MAJOR ? gemm::NO_TRANS : gemm::TRANS,
+				in.get_rows(), cols, rows,
+				(T)1, in.line(0), in.stride(), this->line(0), ld,
+				(T)1, out.line(0), out.stride());
+		}
+
+		// x(b, i) += sum_j this(i, j)*y(b, j), project_back for every row.
+		void project_back_batch(const DenseMatrix<T> &y, DenseMatrix<T> &x) const {
+			gemm::gemm<T>(
+				gemm::NO_TRANS, layout == ROW_MAJOR ? gemm::TRANS : gemm::NO_TRANS,
+				y.get_rows(), rows, cols,
+				(T)1, y.line(0), y.stride(), this->line(0), ld,
+				(T)1, x.line(0), x.stride());
+		}
+
+		// this(i, j) += sum_b x(b, i)*y(b, j), the sum of the outer products of matching rows.
+		void add_outer_batch(const DenseMatrix<T> &x, const DenseMatrix<T> &y){
+			if(layout == ROW_MAJOR){
+				gemm::gemm<T>(gemm::TRANS, gemm::NO_TRANS, rows, cols, x.get_rows(),
+					(T)1, x.line(0), x.stride(), y.line(0), y.stride(), (T)1, this->line(0), ld);
+			} else {
+				gemm::gemm<T>(gemm::TRANS, gemm::NO_TRANS, cols, rows, x.get_rows(),
+					(T)1, y.line(0), y.stride(), x.line(0), x.stride(), (T)1, this->line(0), ld);
+			}
+		}
+};
+
+#endif
@@ -4,12 +4,508 @@
 #include <vector>
 #include <algorithm>
 #include <complex>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <array>
+#include <utility>
+
+#include "span.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
 
 using std::vector;
 using std::complex;
 
 const long double PI_FFT = 3.14159265358979323;
 
+// the batched transforms go through this many signals at a time,
+// stored together while a group takes less than FFT_BATCH_BYTES.
+const int32_t FFT_BATCH_GROUP = 16;
+const int32_t FFT_BATCH_BYTES = 1<<16;
+
+// complex transforms at least this long are split into short ones, see FFT::four_step.
+const int32_t FFT_FOUR_STEP_SIZE = 1<<16;
+
+namespace fft_kernels{
+
+	/*
+	   The SIMD version of the FFT stages (FFT::pass), on split
+	   complex data: the real parts in one array and the imaginary
+	   parts in another, so a vector register holds the real (or
+	   imaginary) parts of W neighbouring values and a complex
+	   multiply is 4 vector multiplies with no shuffling.
+
+	   A stage combines p blocks of length L, value j of every
+	   block is independent of the others, so W consecutive j's
+	   are done at once and the twiddles (stored split too, per
+	   stage, twiddle r of value j at (r-1)*L+j) load straight
+	   into registers. The j's left over at the end of a block
+	   go one at a time.
+
+	   The innermost stages have blocks shorter than W, so
+	   they go across the blocks instead (batch_pass): with the
+	   n/Q blocks of length Q stored value by value, value i of
+	   every block side by side, they're n/Q transforms of
+	   length Q done W at a time, see FFT::transform.
+
+	   Like the kernels in func/kernels, the bodies are templates
+	   force-inlined into wrappers with a target attribute, one
+	   set per ISA, and the widest one the CPU has is chosen
+	   at run time. Without any (or off x86) FFT keeps using
+	   its complex<T> passes.
+	*/
+
+	template<class T> struct Table{
+		// pass[p](re, im, n, L, wr, wi, cs, sn) for p = 2, 3, 4, 5, 7.
+		void (*pass[8])(T*, T*, int32_t, int32_t, const T*, const T*, const T*, const T*);
+		// batch_pass[p](re, im, n, L, count, wr, wi, cs, sn), count transforms at once.
+		void (*batch_pass[8])(T*, T*, int32_t, int32_t, int32_t, const T*, const T*, const T*, const T*);
+		// values per vector, 0 without SIMD.
+		int32_t width;
+	};
+
+	// a whole transform of one length, see FFT::fixed. The T*
+	// is work space for 4*n values.
+	template<class T> using Fixed = void (*)(complex<T>*, T*);
+
+	/*
+	   The tables of the transforms of a length N known at compile
+	   time (FFT::fixed), the same as the ones of FFT::build but
+	   made by the compiler, so they're constants in the code.
+
+	   The stages with L < W (the SIMD width) go across the N/Q
+	   blocks of length Q (the product of their p's) as in
+	   FFT::build: value k of block b at k*(N/Q)+b, W blocks per
+	   vector. The digit reversal puts the values straight there
+	   and one transpose brings them back for the rest of the
+	   stages.
+	*/
+	namespace fixed{
+
+		constexpr long double PI = 3.14159265358979323846264338327950288L;
+
+		// sin(2pi*turn) without <cmath>, the series converges fast within half a turn.
+		constexpr long double sin_turn(long double turn){
+			turn -= (int64_t)turn;
+			if(turn > 0.5L) turn -= 1;
+			if(turn < -0.5L) turn += 1;
+			long double x = 2*PI*turn, term = x, sum = x;
+			for(int32_t k=1; k<40; k++){
+				term *= -x*x/((2*k)*(2*k+1));
+				sum += term;
+			}
+			return sum;
+		}
+
+		constexpr long double cos_turn(long double turn){
+			return sin_turn(turn+0.25L);
+		}
+
+		template<int32_t N, int32_t W> struct Shape{
+
+			// the stages innermost first, as in FFT::build.
+			int32_t count = 0, p[32] = {}, L[32] = {};
+
+			// the first columns stages run on Q long columns, see above.
+			int32_t columns = 0, Q = 1;
+
+			// where the split twiddles (wr, wi) & the odd p tables (cs, sn) of each stage start.
+			int32_t tw[32] = {}, odd[32] = {}, tw_size = 0, odd_size = 0;
+
+			constexpr Shape(){
+
+				int32_t n = N, outer[32] = {};
+				for(int32_t f : {4, 2, 3, 5, 7}){
+					while(n%f == 0){
+						outer[this->count++] = f;
+						n /= f;
+					}
+				}
+				if(n != 1) this->count = 0;
+
+				int32_t len = 1;
+				for(int32_t k=0; k<this->count; k++){
+					this->p[k] = outer[this->count-1-k];
+					this->L[k] = len;
+					this->tw[k] = this->tw_size;
+					this->odd[k] = this->odd_size;
+					this->tw_size += len*(this->p[k]-1);
+					if(this->p[k]&1) this->odd_size += (this->p[k]-1)/2*((this->p[k]-1)/2);
+					len *= this->p[k];
+
+					if(this->columns == k && this->L[k] < W && N/len >= W){
+						this->columns = k+1;
+						this->Q = len;
+					}
+				}
+			}
+
+			// input i goes to perm(i), the digit reversal of FFT::build (in the columns).
+			constexpr int32_t perm(int32_t i) const {
+				int32_t x = i, block = N, pos = 0;
+				for(int32_t k=this->count-1; k>=0; k--){
+					block /= this->p[k];
+					pos += x%this->p[k]*block;
+					x /= this->p[k];
+				}
+				if(this->columns) pos = pos%this->Q*(N/this->Q)+pos/this->Q;
+				return pos;
+			}
+		};
+
+		template<int32_t N, int32_t W> constexpr Shape<N, W> shape{};
+
+		template<int32_t N, int32_t W> constexpr std::array<int32_t, N> make_perm(){
+			std::array<int32_t, N> a{};
+			for(int32_t i=0; i<N; i++) a[i] = shape<N, W>.perm(i);
+			return a;
+		}
+
+		// the twiddles of the stages (twiddle r of value j at (r-1)*L+j), cos if real.
+		template<class T, int32_t N, int32_t W> constexpr std::array<T, shape<N, W>.tw_size+1> make_twiddles(bool real){
+			constexpr Shape<N, W> sh = shape<N, W>;
+			std::array<T, sh.tw_size+1> a{};
+			for(int32_t k=0; k<sh.count; k++){
+				int32_t p = sh.p[k], L = sh.L[k];
+				for(int32_t r=1; r<p; r++){
+					for(int32_t j=0; j<L; j++){
+						long double turn = (long double)j*r/((long double)p*L);
+						a[sh.tw[k]+(r-1)*L+j] = (T)(real ? cos_turn(turn) : sin_turn(turn));
+					}
+				}
+			}
+			return a;
+		}
+
+		// cos (or sin) of 2pi*q*r/p for the odd stages, at (q-1)*H+r-1.
+		template<class T, int32_t N, int32_t W> constexpr std::array<T, shape<N, W>.odd_size+1> make_odd(bool real){
+			constexpr Shape<N, W> sh = shape<N, W>;
+			std::array<T, sh.odd_size+1> a{};
+			for(int32_t k=0; k<sh.count; k++){
+				int32_t p = sh.p[k], H = (p-1)/2;
+				if(!(p&1)) continue;
+				for(int32_t q=1; q<=H; q++){
+					for(int32_t r=1; r<=H; r++){
+						long double turn = (long double)(q*r%p)/p;
+						a[sh.odd[k]+(q-1)*H+r-1] = (T)(real ? cos_turn(turn) : sin_turn(turn));
+					}
+				}
+			}
+			return a;
+		}
+
+		template<class T, int32_t N, int32_t W> struct Tables{
+			static constexpr Shape<N, W> shape = fixed::shape<N, W>;
+			static constexpr std::array<int32_t, N> perm = make_perm<N, W>();
+			static constexpr std::array<T, shape.tw_size+1> wr = make_twiddles<T, N, W>(1);
+			static constexpr std::array<T, shape.tw_size+1> wi = make_twiddles<T, N, W>(0);
+			static constexpr std::array<T, shape.odd_size+1> cs = make_odd<T, N, W>(1);
+			static constexpr std::array<T, shape.odd_size+1> sn = make_odd<T, N, W>(0);
+		};
+
+		/*
+		   The lengths FFT::fixed(n) has code for. Each one is
+		   compiled for every ISA, so only the ones measured to
+		   beat their plans and worth it: the transforms of the
+		   layers on 784 (28x28) samples, 784 for the sparse
+		   convolutions (2*784-1 long) and 512 for the convolutions
+		   of up to 240 outputs. At 1024 and up the plans are as fast.
+		*/
+		template<int32_t... N> struct Sizes{};
+		typedef Sizes<512, 784> sizes;
+	}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define CAKE_INLINE inline __attribute__((always_inline))
+
+	namespace simd{
+
+		template<class V, class T> CAKE_INLINE void load(V &r, const T *p){
+			__builtin_memcpy(&r, p, sizeof(V));
+		}
+
+		template<class V, class T> CAKE_INLINE void store(T *p, const V &v){
+			__builtin_memcpy(p, &v, sizeof(V));
+		}
+
+		/*
+		   Value j of the P blocks of one stage, for W j's at once.
+		   The values are L apart and their twiddles tw apart. With
+		   Splat the W values share one twiddle (batch_pass, where
+		   the W values are the same j of different transforms).
+		*/
+		template<class V, class T, int32_t P, bool Splat = 0> CAKE_INLINE void butterfly(
+				T *re, T *im, int32_t L, const T *wr, const T *wi, int32_t tw, const T *cs, const T *sn){
+
+			const int32_t H = (P-1)/2;
+			V tr[P], ti[P];
+
+			load(tr[0], re);
+			load(ti[0], im);
+#pragma GCC unroll 8
+			for(int32_t r=1; r<P; r++){
+				V xr, xi, cr, ci;
+				load(xr, re+r*L);
+				load(xi, im+r*L);
+				if constexpr(Splat){
+					cr = wr[(r-1)*tw]+V{};
+					ci = wi[(r-1)*tw]+V{};
+				} else {
+					load(cr, wr+(r-1)*tw);
+					load(ci, wi+(r-1)*tw);
+				}
+				tr[r] = xr*cr-xi*ci;
+				ti[r] = xr*ci+xi*cr;
+			}
+
+			if constexpr(P == 2){
+				store(re, tr[0]+tr[1]);
+				store(im, ti[0]+ti[1]);
+				store(re+L, tr[0]-tr[1]);
+				store(im+L, ti[0]-ti[1]);
+			} else if constexpr(P == 4){
+				// the same as the complex version, i*d = (-d.im, d.re).
+				V ar = tr[0]+tr[2], ai = ti[0]+ti[2], br = tr[0]-tr[2], bi = ti[0]-ti[2];
+				V cr = tr[1]+tr[3], ci = ti[1]+ti[3], dr = tr[1]-tr[3], di = ti[1]-ti[3];
+				store(re, ar+cr);
+				store(im, ai+ci);
+				store(re+L, br-di);
+				store(im+L, bi+dr);
+				store(re+2*L, ar-cr);
+				store(im+2*L, ai-ci);
+				store(re+3*L, br+di);
+				store(im+3*L, bi-dr);
+			} else {
+				V ar[H+1], ai[H+1], br[H+1], bi[H+1];
+				V sr = tr[0], si = ti[0];
+#pragma GCC unroll 8
+				for(int32_t r=1; r<=H; r++){
+					ar[r] = tr[r]+tr[P-r];
+					ai[r] = ti[r]+ti[P-r];
+					br[r] = tr[r]-tr[P-r];
+					bi[r] = ti[r]-ti[P-r];
+					sr += ar[r];
+					si += ai[r];
+				}
+				store(re, sr);
+				store(im, si);
+#pragma GCC unroll 8
+				for(int32_t q=1; q<=H; q++){
+					V er = tr[0], ei = ti[0], mr = {}, mi = {};
+#pragma GCC unroll 8
+					for(int32_t r=1; r<=H; r++){
+						T c = cs[(q-1)*H+r-1], s = sn[(q-1)*H+r-1];
+						er += c*ar[r];
+						ei += c*ai[r];
+						mr += s*br[r];
+						mi += s*bi[r];
+					}
+					// X[q] = e + i*m, X[P-q] = e - i*m.
+					store(re+q*L, er-mi);
+					store(im+q*L, ei+mr);
+					store(re+(P-q)*L, er+mi);
+					store(im+(P-q)*L, ei-mr);
+				}
+			}
+		}
+
+		template<class V, class T, int32_t P> CAKE_INLINE void pass(
+				T *re, T *im, int32_t n, int32_t L, const T *wr, const T *wi, const T *cs, const T *sn){
+
+			typedef T S __attribute__((vector_size(sizeof(T))));
+			const int32_t W = sizeof(V)/sizeof(T), M = P*L;
+
+			for(int32_t base=0; base<n; base+=M){
+				int32_t j = 0;
+				for(; j+W<=L; j+=W) butterfly<V, T, P>(re+base+j, im+base+j, L, wr+j, wi+j, L, cs, sn);
+				for(; j<L; j++) butterfly<S, T, P>(re+base+j, im+base+j, L, wr+j, wi+j, L, cs, sn);
+			}
+		}
+
+		/*
+		   pass for count transforms at once, stored value by value:
+		   value i of transform b at i*count+b. Value j of a block is
+		   then count values in a row, all with the same twiddles.
+		*/
+		template<class V, class T, int32_t P> CAKE_INLINE void batch_pass(
+				T *re, T *im, int32_t n, int32_t L, int32_t count,
+				const T *wr, const T *wi, const T *cs, const T *sn){
+
+			typedef T S __attribute__((vector_size(sizeof(T))));
+			const int32_t W = sizeof(V)/sizeof(T), M = P*L, step = L*count;
+
+			for(int32_t base=0; base<n; base+=M){
+				for(int32_t j=0; j<L; j++){
+					T *r0 = re+(size_t)(base+j)*count, *i0 = im+(size_t)(base+j)*count;
+					int32_t b = 0;
+					for(; b+W<=count; b+=W) butterfly<V, T, P, 1>(r0+b, i0+b, step, wr+j, wi+j, L, cs, sn);
+					for(; b<count; b++) butterfly<S, T, P, 1>(r0+b, i0+b, step, wr+j, wi+j, L, cs, sn);
+				}
+			}
+		}
+
+		// stage K of the fixed transform of length N, see fixed::Tables.
+		template<class V, class T, int32_t N, int32_t K> CAKE_INLINE void fixed_stage(T *re, T *im){
+
+			typedef T S __attribute__((vector_size(sizeof(T))));
+			const int32_t W = sizeof(V)/sizeof(T);
+			typedef fixed::Tables<T, N, W> X;
+
+			constexpr int32_t P = X::shape.p[K], L = X::shape.L[K], M = P*L;
+			const T *wr = X::wr.data()+X::shape.tw[K], *wi = X::wi.data()+X::shape.tw[K];
+			const T *cs = X::cs.data()+X::shape.odd[K], *sn = X::sn.data()+X::shape.odd[K];
+
+			if constexpr(K < X::shape.columns){
+				constexpr int32_t C = N/X::shape.Q, step = L*C;
+				for(int32_t base=0; base<X::shape.Q; base+=M){
+					for(int32_t j=0; j<L; j++){
+						T *r0 = re+(base+j)*C, *i0 = im+(base+j)*C;
+						int32_t b = 0;
+						for(; b+W<=C; b+=W) butterfly<V, T, P, 1>(r0+b, i0+b, step, wr+j, wi+j, L, cs, sn);
+						for(; b<C; b++) butterfly<S, T, P, 1>(r0+b, i0+b, step, wr+j, wi+j, L, cs, sn);
+					}
+				}
+			} else {
+				for(int32_t base=0; base<N; base+=M){
+					int32_t j = 0;
+					for(; j+W<=L; j+=W) butterfly<V, T, P>(re+base+j, im+base+j, L, wr+j, wi+j, L, cs, sn);
+					for(; j<L; j++) butterfly<S, T, P>(re+base+j, im+base+j, L, wr+j, wi+j, L, cs, sn);
+				}
+			}
+		}
+
+		// stages first, first+1, ...
+		template<class V, class T, int32_t N, int32_t first, int32_t... K> CAKE_INLINE void fixed_stages(
+				T *re, T *im, std::integer_sequence<int32_t, K...>){
+			(fixed_stage<V, T, N, first+K>(re, im), ...);
+		}
+
+		template<class V, class T, int32_t N> CAKE_INLINE void fixed_transform(complex<T> *v, T *work){
+
+			const int32_t W = sizeof(V)/sizeof(T);
+			typedef fixed::Tables<T, N, W> X;
+			constexpr int32_t columns = X::shape.columns, Q = X::shape.Q, C = N/Q;
+
+			T *re = work, *im = work+N;
+			for(int32_t i=0; i<N; i++){
+				re[X::perm[i]] = v[i].real();
+				im[X::perm[i]] = v[i].imag();
+			}
+
+			fixed_stages<V, T, N, 0>(re, im, std::make_integer_sequence<int32_t, columns>());
+
+			if constexpr(columns > 0){
+				T *tr = work+2*N, *ti = work+3*N;
+				for(int32_t k=0; k<Q; k++){
+					for(int32_t b=0; b<C; b++){
+						tr[b*Q+k] = re[k*C+b];
+						ti[b*Q+k] = im[k*C+b];
+					}
+				}
+				re = tr;
+				im = ti;
+			}
+
+			fixed_stages<V, T, N, columns>(re, im, std::make_integer_sequence<int32_t, X::shape.count-columns>());
+
+			for(int32_t i=0; i<N; i++) v[i] = {re[i], im[i]};
+		}
+
+#define CAKE_FFT_PASS(TARGET, P) \
+			__attribute__((target(TARGET))) inline void pass##P(T *re, T *im, int32_t n, int32_t L, \
+					const T *wr, const T *wi, const T *cs, const T *sn){ \
+				simd::pass<V, T, P>(re, im, n, L, wr, wi, cs, sn); } \
+			__attribute__((target(TARGET))) inline void batch_pass##P(T *re, T *im, int32_t n, int32_t L, \
+					int32_t count, const T *wr, const T *wi, const T *cs, const T *sn){ \
+				simd::batch_pass<V, T, P>(re, im, n, L, count, wr, wi, cs, sn); }
+
+#define CAKE_FFT_SET(ISA, TARGET, T_, V_) \
+		namespace ISA{ \
+			typedef T_ T; \
+			typedef kernels::simd::V_ V; \
+			CAKE_FFT_PASS(TARGET, 2) CAKE_FFT_PASS(TARGET, 3) CAKE_FFT_PASS(TARGET, 4) \
+			CAKE_FFT_PASS(TARGET, 5) CAKE_FFT_PASS(TARGET, 7) \
+			template<int32_t N> __attribute__((target(TARGET))) inline void transform(complex<T> *v, T *work){ \
+				simd::fixed_transform<V, T, N>(v, work); } \
+			inline Table<T> table(T){ return { \
+				{NULL, NULL, pass2, pass3, pass4, pass5, NULL, pass7}, \
+				{NULL, NULL, batch_pass2, batch_pass3, batch_pass4, batch_pass5, NULL, batch_pass7}, \
+				(int32_t)(sizeof(V)/sizeof(T))}; } \
+		}
+
+		namespace f32{
+			CAKE_FFT_SET(sse2, "sse2", float, f32x4)
+			CAKE_FFT_SET(avx2, "avx2,fma", float, f32x8)
+			CAKE_FFT_SET(avx512, "avx512f", float, f32x16)
+		}
+
+		namespace f64{
+			CAKE_FFT_SET(sse2, "sse2", double, f64x2)
+			CAKE_FFT_SET(avx2, "avx2,fma", double, f64x4)
+			CAKE_FFT_SET(avx512, "avx512f", double, f64x8)
+		}
+
+#undef CAKE_FFT_SET
+#undef CAKE_FFT_PASS
+
+		template<class T> Table<T> select_table(){
+			switch(kernels::active_isa()){
+				case kernels::ISA_AVX512:
+					if constexpr(std::is_same<T, float>::value) return f32::avx512::table((T)0);
+					else return f64::avx512::table((T)0);
+				case kernels::ISA_AVX2:
+					if constexpr(std::is_same<T, float>::value) return f32::avx2::table((T)0);
+					else return f64::avx2::table((T)0);
+				case kernels::ISA_SSE2:
+					if constexpr(std::is_same<T, float>::value) return f32::sse2::table((T)0);
+					else return f64::sse2::table((T)0);
+				default: return {};
+			}
+		}
+
+		template<class T, int32_t N> Fixed<T> select_fixed(){
+			switch(kernels::active_isa()){
+				case kernels::ISA_AVX512:
+					if constexpr(std::is_same<T, float>::value) return f32::avx512::transform<N>;
+					else return f64::avx512::transform<N>;
+				case kernels::ISA_AVX2:
+					if constexpr(std::is_same<T, float>::value) return f32::avx2::transform<N>;
+					else return f64::avx2::transform<N>;
+				case kernels::ISA_SSE2:
+					if constexpr(std::is_same<T, float>::value) return f32::sse2::transform<N>;
+					else return f64::sse2::transform<N>;
+				default: return NULL;
+			}
+		}
+	}
+
+#undef CAKE_INLINE
+
+	template<class T> Table<T> select_table(){ return {}; }
+	template<> inline Table<float> select_table<float>(){ return simd::select_table<float>(); }
+	template<> inline Table<double> select_table<double>(){ return simd::select_table<double>(); }
+
+	template<class T, int32_t N> Fixed<T> select_fixed(){
+		if constexpr(std::is_same<T, float>::value || std::is_same<T, double>::value) return simd::select_fixed<T, N>();
+		else return NULL;
+	}
+
+#else
+
+	template<class T> Table<T> select_table(){ return {}; }
+
+	template<class T, int32_t N> Fixed<T> select_fixed(){ return NULL; }
+
+#endif
+
+	template<class T> const Table<T> &table(){
+		static const Table<T> t = select_table<T>();
+		return t;
+	}
+}
+
 template<class T> class FFT{
 
 	/*
@@ -32,8 +528,14 @@ template<class T> class FFT{
 	   Reducible's video on FFT, the take is similar to the blog post's:
        https://www.youtube.com/watch?v=h7apO7q16V0&t=902s
 
-	   The implementation I use is referred
-	   to as the "bit reverse" technique, I believe.
+	   The transforms here are iterative mixed radix
+	   Cooley-Tukey, the "bit reverse" technique generalized
+	   from radix 2 to radices 2, 3, 4, 5 and 7 (radix 4 first,
+	   so there are half as many passes as with radix 2). Lengths
+	   made of other primes go through Bluestein's algorithm.
+	   On x86 the passes run on SIMD, see fft_kernels above.
+	   The long transforms (FFT_FOUR_STEP_SIZE and up) are made
+	   of short ones instead, spread over threads (four_step).
 	   Comments on the implementation assume that the reader
 	   understands the basic recursive implementation of
 	   fft well.
@@ -42,140 +544,982 @@ template<class T> class FFT{
 
 	protected:
 
-		int32_t B = 0;
-		vector<vector<complex<T> > > w;
-		vector<int32_t > invbit;		
+		// combining p transforms of length L into one of length p*L.
+		struct Stage{
+			int32_t p = 0, L = 0;
+			// twiddle[j*(p-1)+r-1] = e^(i*2pi*j*r/(p*L))
+			vector<complex<T> > twiddle;
+			// the same split for the SIMD passes, wr[(r-1)*L+j] + i*wi[(r-1)*L+j]
+			vector<T> wr, wi;
+			// cos & sin of 2pi*q*r/p, q, r = 1...(p-1)/2, for odd p
+			vector<T> cs, sn;
+		};
 
-	public:
+		/*
+		   Everything about transforms of one length n, made once
+		   (see plan) and never changed after, so any number
+		   of threads can use a plan at the same time.
+		*/
+		struct Plan{
+			int32_t n = 0;
 
-		FFT(){
-			B = 0;
-			resize_precalc_tables();
+			// innermost first.
+			vector<Stage> stages;
+
+			// where the digit reversal puts input i.
+			vector<int32_t> perm;
+
+			// with the SIMD passes, the first columns stages go across
+			// the n/Q blocks of length Q (see transform) and the digit
+			// reversal puts input i at column_perm[i] in that layout.
+			int32_t columns = 0, Q = 1;
+			vector<int32_t> column_perm;
+
+			// root[k] = e^(i*pi*k/n), the twiddles of the real FFTs of length 2n.
+			vector<complex<T> > root;
+
+			// Bluestein's algorithm, when n isn't 7-smooth: the chirp
+			// e^(i*pi*t^2/n) and the transform of its conjugate at length m.
+			int32_t m = 0;
+			vector<complex<T> > chirp, chirp_spectrum;
+
+			// the compile time version of the transform, see fixed.
+			std::atomic<fft_kernels::Fixed<T> > fixed{NULL};
+
+			// n = rows*cols for the four step transform of the long ones,
+			// with e^(i*2pi*t/n) = coarse[t/1024]*fine[t%1024].
+			int32_t rows = 0, cols = 0;
+			vector<complex<T> > coarse, fine;
+
+			Plan *next = NULL;
+		};
+
+		// the plans made so far, a list that's only ever added to.
+		std::atomic<Plan*> plans;
+		std::mutex plan_mutex;
+
+		static complex<T> unit(long double turn){
+			return std::polar((T)1, (T)(2*PI_FFT*turn));
 		}
 
-		FFT(int32_t B_){
-			B = B_;
-			resize_precalc_tables();
+		// the factors of n from {4, 2, 3, 5, 7} (outermost first), empty if there are others.
+		static vector<int32_t> factorize(int32_t n){
+			vector<int32_t> factors;
+			for(int32_t p : {4, 2, 3, 5, 7}){
+				while(n%p == 0){
+					factors.push_back(p);
+					n /= p;
+				}
+			}
+			if(n != 1) factors.clear();
+			return factors;
 		}
 
-		void resize_precalc_tables(){
-			
-			while((int32_t)w.size() <= B){
-				
+		// no allocations, it's on the path of every convolution (transform_size).
+		static bool smooth(int32_t n){
+			if(n < 1) return 0;
+			for(int32_t p : {2, 3, 5, 7}){
+				while(n%p == 0) n /= p;
+			}
+			return n == 1;
+		}
+
+		static int32_t next_smooth(int32_t n){
+			n = std::max(n, 1);
+			while(!smooth(n)) n++;
+			return n;
+		}
+
+		Plan *find(int32_t n){
+			for(Plan *p = this->plans.load(std::memory_order_acquire); p != NULL; p = p->next){
+				if(p->n == n) return p;
+			}
+			return NULL;
+		}
+
+		// plan_mutex must be held.
+		Plan *build(int32_t n){
+
+			Plan *found = this->find(n);
+			if(found) return found;
+
+			Plan *plan = new Plan();
+			plan->n = n;
+
+			plan->root.resize(n);
+			for(int32_t k=0; k<n; k++) plan->root[k] = unit((long double)k/(2*n));
+
+			vector<int32_t> factors = factorize(n);
+
+			if(n > 1 && factors.empty()){
+
 				/*
+				   Bluestein: with jk = (j^2 + k^2 - (k-j)^2)/2,
+
+				   X[k] = sum_j x[j]*e^(i*2pi*jk/n)
+				        = c[k] * sum_j (x[j]*c[j]) * conj(c[k-j]),  c[t] = e^(i*pi*t^2/n)
+
+				   which is a convolution, done with smooth length FFTs.
+				*/
 
-				   precalculate w[b][x] = e^(i*pi*x/(2^b))
+				plan->m = next_smooth(2*n-1);
+				Plan *inner = this->build(plan->m);
 
-				   and the invbit array:
-				   examples in base 2 of the invbit array:
+				plan->chirp.resize(n);
+				for(int64_t t=0; t<n; t++) plan->chirp[t] = unit((long double)(t*t%(2*n))/(2*n));
 
-				   invbit[1000111] = 1110001
-				   invbit[0] = 0
-				   invbit[10110111] = 11101101
+				plan->chirp_spectrum.assign(plan->m, complex<T>(0, 0));
+				for(int32_t t=0; t<n; t++){
+					plan->chirp_spectrum[t] = std::conj(plan->chirp[t]);
+					if(t) plan->chirp_spectrum[plan->m-t] = std::conj(plan->chirp[t]);
+				}
+				this->transform(plan->chirp_spectrum.data(), inner);
+
+			} else if(n >= FFT_FOUR_STEP_SIZE){
+
+				// as square as n allows, so both the short transforms stay in the cache.
+				int32_t rows = 1;
+				for(int32_t d=2; (int64_t)d*d<=n; d++) if(n%d == 0) rows = d;
+				plan->rows = rows;
+				plan->cols = n/rows;
+				this->build(plan->rows);
+				this->build(plan->cols);
 
-				   it reverses the bit order.
+				plan->fine.resize(1024);
+				for(int32_t l=0; l<1024; l++) plan->fine[l] = unit((long double)l/n);
+				plan->coarse.resize(n/1024+1);
+				for(int32_t h=0; h<=n/1024; h++) plan->coarse[h] = unit((long double)h*1024/n);
 
+			} else {
+
+				/*
+				   Input i = d0 + p0*(d1 + p1*(d2 + ...)) goes to
+				   d0*(n/p0) + d1*(n/(p0*p1)) + ..., the digits reversed,
+				   so that each stage combines neighbouring blocks.
 				*/
 
-				int32_t z = 1<<w.size();
-				vector<complex<T> > prec(z);
-				for(int32_t i=0; i<z; i++) prec[i] = std::polar((T)1, (T)(PI_FFT*i/z));
-				w.push_back(prec);
+				plan->perm.resize(n);
+				for(int32_t i=0; i<n; i++){
+					int32_t x = i, block = n, pos = 0;
+					for(int32_t p : factors){
+						block /= p;
+						pos += x%p*block;
+						x /= p;
+					}
+					plan->perm[i] = pos;
+				}
+
+				int32_t L = 1;
+				for(int32_t k=(int32_t)factors.size()-1; k>=0; k--){
+
+					Stage stage;
+					stage.p = factors[k];
+					stage.L = L;
+
+					int32_t p = stage.p;
+					stage.twiddle.resize((size_t)L*(p-1));
+					stage.wr.resize((size_t)L*(p-1));
+					stage.wi.resize((size_t)L*(p-1));
+					for(int32_t j=0; j<L; j++){
+						for(int32_t r=1; r<p; r++){
+							complex<T> w = unit((long double)j*r/((long double)p*L));
+							stage.twiddle[(size_t)j*(p-1)+r-1] = w;
+							stage.wr[(size_t)(r-1)*L+j] = w.real();
+							stage.wi[(size_t)(r-1)*L+j] = w.imag();
+						}
+					}
+
+					int32_t h = (p-1)/2;
+					if(p&1){
+						for(int32_t q=1; q<=h; q++){
+							for(int32_t r=1; r<=h; r++){
+								complex<T> e = unit((long double)(q*r%p)/p);
+								stage.cs.push_back(e.real());
+								stage.sn.push_back(e.imag());
+							}
+						}
+					}
+
+					plan->stages.push_back(stage);
+					L *= p;
+				}
 
-				invbit.resize(z, 0);
-				for(int i=0; i<z/2; i++){
-					invbit[i] <<= 1;
-					invbit[i+z/2] = invbit[i]+1;
+				// the stages on blocks shorter than a vector, while
+				// there are enough blocks to fill one.
+				int32_t width = fft_kernels::table<T>().width, len = 1;
+				for(int32_t k=0; k<(int32_t)plan->stages.size(); k++){
+					len *= plan->stages[k].p;
+					if(plan->stages[k].L >= width || n/len < width) break;
+					plan->columns = k+1;
+					plan->Q = len;
+				}
+				if(plan->columns){
+					int32_t C = n/plan->Q;
+					plan->column_perm.resize(n);
+					for(int32_t i=0; i<n; i++){
+						int32_t pos = plan->perm[i];
+						plan->column_perm[i] = pos%plan->Q*C+pos/plan->Q;
+					}
 				}
 			}
 
+			plan->next = this->plans.load(std::memory_order_relaxed);
+			this->plans.store(plan, std::memory_order_release);
+			return plan;
 		}
 
-		void fft(vector<complex<T> > &v){
-			
-			/*
-			   let's examine how the recursive FFT changes
-			   the ordering of the input array:
-			   
-			   [000, 001, 010, 011, 100, 101, 110, 111]
-			   [000, 010, 100, 110], [001, 011, 101, 111]
-			   [000, 100], [010, 110], [001, 101], [011, 111]
-			   [000], [100], [010], [110], [001], [101], [011], [111]
+		// the plan for length n, made on first use.
+		Plan *plan(int32_t n){
+			Plan *found = this->find(n);
+			if(found) return found;
+			std::lock_guard<std::mutex> lock(this->plan_mutex);
+			return this->build(n);
+		}
+
+		// a*b without the inf/nan checks of complex's operator*, which keep it from being inlined.
+		static complex<T> mul(const complex<T> &a, const complex<T> &b){
+			return {a.real()*b.real()-a.imag()*b.imag(), a.real()*b.imag()+a.imag()*b.real()};
+		}
+
+		// one stage of radix P over the whole array.
+		template<int32_t P> static void pass(complex<T> *v, int32_t n, const Stage &stage){
+
+			const int32_t L = stage.L, M = P*L, H = (P-1)/2;
+			const complex<T> *tw = stage.twiddle.data();
+
+			for(int32_t base=0; base<n; base+=M){
+				for(int32_t j=0; j<L; j++){
+
+					complex<T> t[P];
+					complex<T> *x = v+base+j;
+
+					t[0] = x[0];
+					for(int32_t r=1; r<P; r++) t[r] = mul(tw[j*(P-1)+r-1], x[r*L]);
+
+					if constexpr(P == 2){
+						x[0] = t[0]+t[1];
+						x[L] = t[0]-t[1];
+					} else if constexpr(P == 4){
+						// w = e^(i*pi/2) = i
+						complex<T> a = t[0]+t[2], b = t[0]-t[2], c = t[1]+t[3], d = t[1]-t[3];
+						d = {-d.imag(), d.real()};
+						x[0] = a+c;
+						x[L] = b+d;
+						x[2*L] = a-c;
+						x[3*L] = b-d;
+					} else {
+						/*
+						   Odd P: pair up r and P-r, the roots of the two
+						   are conjugates, so with a = t[r]+t[P-r], b = t[r]-t[P-r]:
+						   X[q] = t[0] + sum_r cos(2pi*q*r/P)*a_r + i*sin(2pi*q*r/P)*b_r
+						   and X[P-q] is the same with -i.
+						*/
+						complex<T> a[H+1], b[H+1];
+						complex<T> sum = t[0];
+						for(int32_t r=1; r<=H; r++){
+							a[r] = t[r]+t[P-r];
+							b[r] = t[r]-t[P-r];
+							sum += a[r];
+						}
+						x[0] = sum;
+						for(int32_t q=1; q<=H; q++){
+							complex<T> re = t[0], im = {0, 0};
+							for(int32_t r=1; r<=H; r++){
+								re += stage.cs[(q-1)*H+r-1]*a[r];
+								im += stage.sn[(q-1)*H+r-1]*b[r];
+							}
+							complex<T> iim = {-im.imag(), im.real()};
+							x[q*L] = re+iim;
+							x[(P-q)*L] = re-iim;
+						}
+					}
+				}
+			}
+		}
 
-			   [000, 100, 010, 110, 001, 101, 011, 111]
-			  
-			   The index of element x in the resulting array
-			   is it's index in the inupt array, but with the binary
-			   representation flipped. This makes sense, since
-			   on each layer we sort the array by the least
-			   significant bit.
+		void transform(complex<T> *v, const Plan *plan){
 
-			   Just reorder the array, then run the basic
-			   FFT algorithm on a loop.
+			int32_t n = plan->n;
 
-			   O(1) extra memory used with O(N*log(N)) preclac,
-			   O(N*log(N)) time with a good constant compared to
-			   the recursive implementation.
-			*/
+			if(plan->m){
+				int32_t m = plan->m;
+				complex<T> *a = scratch(3, m);
+				for(int32_t j=0; j<n; j++) a[j] = v[j]*plan->chirp[j];
+				std::fill(a+n, a+m, complex<T>(0, 0));
 
-			int32_t n = v.size(), b = 0;
-			while((1<<b) < n) b++;
+				const Plan *inner = this->plan(m);
+				this->transform(a, inner);
+				for(int32_t k=0; k<m; k++) a[k] *= plan->chirp_spectrum[k];
+				// inverse
+				this->transform(a, inner);
+				std::reverse(a+1, a+m);
 
-			// the invbit array for b-1 is the same as for b,
-			// but each element is shifted back by 1 bit.
-			int32_t shift = B-b;
+				for(int32_t k=0; k<n; k++) v[k] = plan->chirp[k]*a[k]/(T)m;
+				return;
+			}
+
+			fft_kernels::Fixed<T> fixed = plan->fixed.load(std::memory_order_acquire);
+			if(fixed != NULL){
+				fixed(v, reinterpret_cast<T*>(scratch(2, 2*n)));
+				return;
+			}
 
-			for(int32_t i=0; i<n; i++){
-				if(i < invbit[i]>>shift) std::swap(v[i], v[invbit[i]>>shift]);
+			if(plan->rows){
+				this->four_step(v, plan);
+				return;
 			}
 
-			for(int32_t r=0; r<b; r++){
-				int32_t rd = 1<<r;
-				for(int32_t i=0; i<n; i+=2*rd){
-					for(int32_t j=i; j<i+rd; j++){
-						complex<T> tmp = w[r][j-i]*v[j+rd];
-						v[j+rd] = v[j]-tmp;
-						v[j] = v[j]+tmp;
+			const fft_kernels::Table<T> &simd = fft_kernels::table<T>();
+
+			if(simd.pass[2] != NULL){
+
+				// split on the way in (with the digit reversal), joined on the way out.
+				T *re = reinterpret_cast<T*>(scratch(2, 2*n)), *im = re+n;
+				const int32_t columns = plan->columns, Q = plan->Q, C = n/Q;
+				const int32_t *perm = columns ? plan->column_perm.data() : plan->perm.data();
+				for(int32_t i=0; i<n; i++){
+					re[perm[i]] = v[i].real();
+					im[perm[i]] = v[i].imag();
+				}
+
+				// the short blocks across, value i of block b at i*C+b, then back in order.
+				for(int32_t k=0; k<columns; k++){
+					const Stage &stage = plan->stages[k];
+					simd.batch_pass[stage.p](re, im, Q, stage.L, C, stage.wr.data(), stage.wi.data(),
+						stage.cs.data(), stage.sn.data());
+				}
+				if(columns){
+					T *tr = re+2*n, *ti = re+3*n;
+					for(int32_t k=0; k<Q; k++){
+						for(int32_t b=0; b<C; b++){
+							tr[b*Q+k] = re[k*C+b];
+							ti[b*Q+k] = im[k*C+b];
+						}
 					}
+					re = tr;
+					im = ti;
+				}
+
+				for(int32_t k=columns; k<(int32_t)plan->stages.size(); k++){
+					const Stage &stage = plan->stages[k];
+					simd.pass[stage.p](re, im, n, stage.L, stage.wr.data(), stage.wi.data(),
+						stage.cs.data(), stage.sn.data());
+				}
+
+				for(int32_t i=0; i<n; i++) v[i] = {re[i], im[i]};
+				return;
+			}
+
+			complex<T> *tmp = scratch(2, n);
+			std::copy(v, v+n, tmp);
+			for(int32_t i=0; i<n; i++) v[plan->perm[i]] = tmp[i];
+
+			for(const Stage &stage : plan->stages){
+				switch(stage.p){
+					case 2: pass<2>(v, n, stage); break;
+					case 3: pass<3>(v, n, stage); break;
+					case 4: pass<4>(v, n, stage); break;
+					case 5: pass<5>(v, n, stage); break;
+					case 7: pass<7>(v, n, stage); break;
 				}
 			}
 		}
 
-		vector<T> convolution(
-				vector<T> &x, vector<T> &y,
-				int32_t n=0, bool inv1=0, bool inv2=0){
-			
-			int32_t b = 0, zx = x.size(), zy = y.size();
+		/*
+		   fft_batch with the signals anywhere: value i of signal b
+		   is read from in[b*in_stride + i*in_step] and its transform
+		   written to out[b*out_stride + i*out_step]. A step other
+		   than 1 makes them columns, out may be in. The signals
+		   that go one by one take the codelets, see fft_batch.
+		*/
+		void batch(const complex<T> *in, size_t in_stride, size_t in_step,
+				complex<T> *out, size_t out_stride, size_t out_step, int32_t n, int32_t count){
+
+			if(n <= 1){
+				if(n == 1 && in != out){
+					for(int32_t b=0; b<count; b++) out[(size_t)b*out_stride] = in[(size_t)b*in_stride];
+				}
+				return;
+			}
+
+			const Plan *plan = this->plan(n);
+			const fft_kernels::Table<T> &simd = fft_kernels::table<T>();
+
+			// a few signals don't fill a vector, they're faster one by one, as are
+			// the long ones, unless they're columns: those are read a row at a time.
+			bool lined = in_step == 1 && out_step == 1;
+			if(plan->m || plan->rows || simd.batch_pass[2] == NULL || count < 4
+					|| (lined && (size_t)n*FFT_BATCH_GROUP*sizeof(complex<T>) >= (size_t)FFT_BATCH_BYTES)){
+				for(int32_t b=0; b<count; b++){
+					const complex<T> *x = in+(size_t)b*in_stride;
+					complex<T> *y = out+(size_t)b*out_stride;
+					if(x == y && lined){
+						this->transform(y, plan);
+						continue;
+					}
+					complex<T> *z = scratch(5, n);
+					for(int32_t i=0; i<n; i++) z[i] = x[(size_t)i*in_step];
+					this->transform(z, plan);
+					for(int32_t i=0; i<n; i++) y[(size_t)i*out_step] = z[i];
+				}
+				return;
+			}
+
+			for(int32_t first=0; first<count; first+=FFT_BATCH_GROUP){
+
+				int32_t group = std::min(FFT_BATCH_GROUP, count-first);
+				T *re = reinterpret_cast<T*>(scratch(2, n*group)), *im = re+(size_t)n*group;
+
+				// signal by signal, or for columns row by row, so each row is read once.
+				if(in_step == 1){
+					for(int32_t b=0; b<group; b++){
+						const complex<T> *x = in+(size_t)(first+b)*in_stride;
+						for(int32_t i=0; i<n; i++){
+							size_t to = (size_t)plan->perm[i]*group+b;
+							re[to] = x[i].real();
+							im[to] = x[i].imag();
+						}
+					}
+				} else {
+					for(int32_t i=0; i<n; i++){
+						const complex<T> *x = in+(size_t)first*in_stride+(size_t)i*in_step;
+						size_t to = (size_t)plan->perm[i]*group;
+						for(int32_t b=0; b<group; b++){
+							re[to+b] = x[(size_t)b*in_stride].real();
+							im[to+b] = x[(size_t)b*in_stride].imag();
+						}
+					}
+				}
+
+				for(const Stage &stage : plan->stages){
+					simd.batch_pass[stage.p](re, im, n, stage.L, group, stage.wr.data(), stage.wi.data(),
+						stage.cs.data(), stage.sn.data());
+				}
+
+				if(out_step == 1){
+					for(int32_t b=0; b<group; b++){
+						complex<T> *y = out+(size_t)(first+b)*out_stride;
+						for(int32_t i=0; i<n; i++) y[i] = {re[(size_t)i*group+b], im[(size_t)i*group+b]};
+					}
+				} else {
+					for(int32_t i=0; i<n; i++){
+						complex<T> *y = out+(size_t)first*out_stride+(size_t)i*out_step;
+						for(int32_t b=0; b<group; b++) y[(size_t)b*out_stride] = {re[(size_t)i*group+b], im[(size_t)i*group+b]};
+					}
+				}
+			}
+		}
+
+		/*
+		   Bailey's four step FFT, for the plans with rows. With
+		   n = R*C, the input j = C*j1 + j2 and the output
+		   k = k1 + R*k2 (v as an R x C array, row j1, column j2):
+
+		   X[k1 + R*k2] = sum_j2 e^(i*2pi*j2*k2/C) * e^(i*2pi*j2*k1/n)
+		                  * sum_j1 v[C*j1 + j2]*e^(i*2pi*j1*k1/R)
+
+		   so that's the length R FFTs of the C columns, the
+		   twiddles, the length C FFTs of the R rows and a
+		   transpose, which the row FFTs do on their way out.
+		   The short FFTs fit in the cache, where every stage of
+		   one long transform would go through memory, and each
+		   step is split between the threads of the pool.
+		*/
+		void four_step(complex<T> *v, const Plan *plan){
+
+			const int32_t n = plan->n, R = plan->rows, C = plan->cols;
+			const int32_t G = FFT_BATCH_GROUP, pieces = 4*parallel::thread_count();
+			const complex<T> *coarse = plan->coarse.data(), *fine = plan->fine.data();
+			complex<T> *out = scratch(6, n);
+
+			// a thread waiting on the steps below may run some other
+			// FFT meanwhile, which mustn't touch the buffers in use here.
+			level()++;
+
+			int32_t groups = (C+G-1)/G;
+			parallel::parallel_for(0, groups, std::max(1, groups/pieces), [&](int32_t a, int32_t b){
+				int32_t first = a*G, last = std::min(C, b*G);
+				this->batch(v+first, 1, C, v+first, 1, C, R, last-first);
+				for(int32_t k1=1; k1<R; k1++){
+					complex<T> *x = v+(size_t)k1*C;
+					int32_t t = (int32_t)((int64_t)first*k1%n);
+					for(int32_t j2=first; j2<last; j2++){
+						x[j2] = mul(x[j2], mul(coarse[t>>10], fine[t&1023]));
+						t += k1;
+						if(t >= n) t -= n;
+					}
+				}
+			});
+
+			// the rows go out as columns, that's the transpose: out[k2*R + k1] = X[k1 + R*k2].
+			groups = (R+G-1)/G;
+			parallel::parallel_for(0, groups, std::max(1, groups/pieces), [&](int32_t a, int32_t b){
+				int32_t first = a*G, last = std::min(R, b*G);
+				this->batch(v+(size_t)first*C, C, 1, out+first, 1, R, C, last-first);
+			});
+
+			parallel::parallel_for(0, R, std::max(1, R/pieces), [&](int32_t a, int32_t b){
+				std::copy(out+(size_t)a*C, out+(size_t)b*C, v+(size_t)a*C);
+			});
+
+			level()--;
+		}
+
+		// the FFT (or inverse) of every column of a P x width array.
+		void columns(complex<T> *a, int32_t P, int32_t width, bool inverse){
+
+			if(P <= 1) return;
+
+			const Plan *plan = this->plan(P);
+			complex<T> *column = scratch(4, P);
+
+			for(int32_t c=0; c<width; c++){
+				for(int32_t r=0; r<P; r++) column[r] = a[(size_t)r*width+c];
+				this->transform(column, plan);
+				if(inverse){
+					std::reverse(column+1, column+P);
+					for(int32_t r=0; r<P; r++) column[r] /= (T)P;
+				}
+				for(int32_t r=0; r<P; r++) a[(size_t)r*width+c] = column[r];
+			}
+		}
+
+		// see fixed(n).
+		template<int32_t... N> bool fixed_in(int32_t n, fft_kernels::fixed::Sizes<N...>){
+			bool found = 0;
+			((found = found || (n == N && this->template fixed<N>())), ...);
+			return found;
+		}
+
+	public:
+
+		FFT(){
+			this->plans.store(NULL);
+		}
+
+		// B_ is kept from the power of 2 tables, reserves for sizes up to 2^B_.
+		FFT(int32_t B_){
+			this->plans.store(NULL);
+			this->reserve(1<<B_);
+		}
+
+		~FFT(){
+			Plan *p = this->plans.load();
+			while(p != NULL){
+				Plan *next = p->next;
+				delete p;
+				p = next;
+			}
+		}
+
+		FFT(const FFT&) = delete;
+		FFT &operator=(const FFT&) = delete;
+
+		// makes the tables for convolutions of size n ahead of time.
+		// Tables are also made on first use, any thread can do that.
+		void reserve(int32_t n){
+			this->plan(this->transform_size(n)/2);
+		}
+
+		/*
+		   v[k] = sum_j v[j]*e^(i*2pi*jk/n), in place, for any n.
+
+		   The input is first put in digit reversed order (for
+		   radix 2 just the bits of the index reversed, see the
+		   blog post). After that each stage combines p
+		   neighbouring transforms of length L into one of length
+		   p*L, innermost stage first, all in place. Applying the
+		   transform again and reversing v[1...n-1] gives n times
+		   the inverse, which is how the inverses here are done.
+		*/
+		void fft(complex<T> *v, int32_t n){
+			if(n <= 1) return;
+			this->transform(v, this->plan(n));
+		}
+
+		void fft(vector<complex<T> > &v){
+			this->fft(v.data(), v.size());
+		}
+
+		/*
+		   Makes the transforms of length N (any N without prime
+		   factors above 7) run on code made for that one length:
+		   the digit reversal and the twiddles are tables made by
+		   the compiler and every radix and loop bound is a
+		   constant, so the stages inline into one function (see
+		   fft_kernels::fixed). After this every fft of length N
+		   takes that path, the batched ones too when they go one
+		   by one (see fft_batch), including the ones of the layers
+		   using this FFT, so a size only has to be made fixed
+		   once. N is the complex length: the real transforms
+		   of size s use N = s/2 (see transform_size). False
+		   without SIMD passes, then nothing changes.
+		*/
+		template<int32_t N> bool fixed(){
+			static_assert(N > 1 && fft_kernels::fixed::shape<N, 1>.count > 0, "N must be 7-smooth");
+			fft_kernels::Fixed<T> f = fft_kernels::select_fixed<T, N>();
+			if(f == NULL) return 0;
+			this->plan(N)->fixed.store(f, std::memory_order_release);
+			return 1;
+		}
+
+		// fixed<n>() if n is one of fft_kernels::fixed::sizes, for the
+		// layers to ask about the lengths they use (at connect_next).
+		bool fixed(int32_t n){
+			return this->fixed_in(n, fft_kernels::fixed::sizes());
+		}
+
+		/*
+		   fft of count signals of length n, signal b at v+b*stride.
+
+		   With the SIMD passes the signals go through the stages
+		   FFT_BATCH_GROUP at a time, stored value by value (value i
+		   of every signal of the group side by side). The twiddles
+		   are then loaded once for the whole group and even the
+		   short innermost blocks fill the vectors. A group of long
+		   signals doesn't fit in the cache though, where one does,
+		   so those (FFT_BATCH_BYTES and up) go one by one, through
+		   the codelet of their length if there's one (see fixed).
+		   The groups that fit keep the passes, they beat the
+		   codelets one signal at a time.
+		*/
+		void fft_batch(complex<T> *v, int32_t n, int32_t count, size_t stride){
+			this->batch(v, stride, 1, v, stride, 1, n, count);
+		}
+
+		/*
+		   Real input FFT. A real signal's transform is symmetric,
+		   X[N-k] = conj(X[k]), so only X[0], ..., X[N/2] are needed.
+		   They come from one N/2 long complex FFT: pack the even
+		   values as the real parts and the odd ones as the imaginary
+		   parts, z[j] = x[2j] + i*x[2j+1]. With Z = fft(z):
+
+		   E[k] = (Z[k] + conj(Z[N/2-k]))/2     (transform of the evens)
+		   O[k] = (Z[k] - conj(Z[N/2-k]))/(2i)  (transform of the odds)
+		   X[k] = E[k] + w^k*O[k],  w = e^(i*2pi/N)
+
+		   and the values k and N/2-k are worked out together, so
+		   it's all done in place. Half the work of a full complex FFT.
+		*/
+
+		// spectrum[0..size/2] = the transform of x (flipped if inv) padded with zeros to size.
+		void rfft(Span<const T> x, int32_t size, complex<T> *spectrum, bool inv = 0){
+			this->rfft_pack(x, size, spectrum, inv);
+			this->fft(spectrum, size/2);
+			this->rfft_unpack(spectrum, size);
+		}
+
+		// z[j] = x[2j] + i*x[2j+1], the input of the N/2 long FFT.
+		void rfft_pack(Span<const T> x, int32_t size, complex<T> *spectrum, bool inv = 0){
+
+			int32_t half = size/2, zx = x.size();
+
+			std::fill(spectrum, spectrum+half+1, complex<T>(0, 0));
+			for(int32_t i=0; i<zx; i++){
+				T val = inv ? x[zx-1-i] : x[i];
+				if(i&1) spectrum[i/2].imag(val);
+				else spectrum[i/2].real(val);
+			}
+		}
+
+		// Z to X, in place.
+		void rfft_unpack(complex<T> *spectrum, int32_t size){
+
+			int32_t half = size/2;
+
+			const vector<complex<T> > &tw = this->plan(half)->root;
+
+			T re = spectrum[0].real(), im = spectrum[0].imag();
+			spectrum[0] = {re+im, 0};
+			spectrum[half] = {re-im, 0};
+
+			for(int32_t k=1; k<=half-k; k++){
+				complex<T> zk = spectrum[k], zh = std::conj(spectrum[half-k]);
+				complex<T> e = (zk+zh)*(T)0.5, o = (zk-zh)*complex<T>(0, -0.5);
+				complex<T> wo = tw[k]*o;
+				spectrum[k] = e+wo;
+				spectrum[half-k] = std::conj(e-wo);
+			}
+		}
+
+		/*
+		   The inverse of rfft: the same steps backwards, recover E and O,
+		   then Z, then z with an inverse N/2 long complex FFT.
+		   out gets the real values first, first+1, ...
+		   The spectrum is used as work space.
+		*/
+		void irfft(complex<T> *spectrum, int32_t size, Span<T> out, int32_t first = 0){
+			this->irfft_pack(spectrum, size);
+			this->fft(spectrum, size/2);
+			this->irfft_unpack(spectrum, size, out, first);
+		}
+
+		// X to Z, in place.
+		void irfft_pack(complex<T> *spectrum, int32_t size){
+
+			int32_t half = size/2;
+
+			const vector<complex<T> > &tw = this->plan(half)->root;
+
+			T x0 = spectrum[0].real(), xh = spectrum[half].real();
+			spectrum[0] = {(x0+xh)*(T)0.5, (x0-xh)*(T)0.5};
+
+			for(int32_t k=1; k<=half-k; k++){
+				complex<T> xk = spectrum[k], xc = std::conj(spectrum[half-k]);
+				complex<T> e = (xk+xc)*(T)0.5, o = (xk-xc)*std::conj(tw[k])*(T)0.5;
+				complex<T> io = complex<T>(-o.imag(), o.real());
+				spectrum[k] = e+io;
+				spectrum[half-k] = std::conj(e)+complex<T>(o.imag(), o.real());
+			}
+		}
+
+		// z from the FFT of Z, to out.
+		void irfft_unpack(complex<T> *spectrum, int32_t size, Span<T> out, int32_t first = 0){
+
+			int32_t half = size/2;
+
+			// inverse
+			std::reverse(spectrum+1, spectrum+half);
+
+			T down = (T)half;
+			for(int32_t i=0; i<(int32_t)out.size(); i++){
+				int32_t j = first+i;
+				out[i] = ((j&1) ? spectrum[j/2].imag() : spectrum[j/2].real())/down;
+			}
+		}
+
+		/*
+		   rfft & irfft for count signals, on fft_batch. Signal b
+		   is zx (or len) values at x+b*stride (out+b*stride),
+		   its spectrum at spectra+b*(size/2+1).
+		*/
+		void rfft_batch(const T *x, int32_t zx, size_t stride, int32_t count, int32_t size,
+				complex<T> *spectra, bool inv = 0){
+
+			int32_t bins = size/2+1;
+
+			for(int32_t b=0; b<count; b++){
+				this->rfft_pack(Span<const T>(x+(size_t)b*stride, zx), size, spectra+(size_t)b*bins, inv);
+			}
+			this->fft_batch(spectra, size/2, count, bins);
+			for(int32_t b=0; b<count; b++) this->rfft_unpack(spectra+(size_t)b*bins, size);
+		}
+
+		void irfft_batch(complex<T> *spectra, int32_t size, int32_t count,
+				T *out, int32_t len, size_t stride, int32_t first = 0){
+
+			int32_t bins = size/2+1;
+
+			for(int32_t b=0; b<count; b++) this->irfft_pack(spectra+(size_t)b*bins, size);
+			this->fft_batch(spectra, size/2, count, bins);
+			for(int32_t b=0; b<count; b++){
+				this->irfft_unpack(spectra+(size_t)b*bins, size, Span<T>(out+(size_t)b*stride, len), first);
+			}
+		}
+
+		/*
+		   2D real FFTs, row-column: an rfft of every row, then a
+		   complex FFT down every column of the result. A rows x cols
+		   signal padded to P x Q (P from fft_size, Q from transform_size)
+		   has a P x (Q/2+1) spectrum, row after row. With inv the
+		   signal is flipped both ways first.
+		*/
+		void rfft2(Span<const T> x, int32_t rows, int32_t cols, int32_t P, int32_t Q,
+				complex<T> *spectrum, bool inv = 0){
+
+			int32_t width = Q/2+1;
+
+			for(int32_t r=0; r<rows; r++){
+				int32_t from = inv ? rows-1-r : r;
+				this->rfft(x.subspan((size_t)from*cols, cols), Q, spectrum+(size_t)r*width, inv);
+			}
+			std::fill(spectrum+(size_t)rows*width, spectrum+(size_t)P*width, complex<T>(0, 0));
+
+			this->columns(spectrum, P, width, 0);
+		}
+
+		/*
+		   The inverse of rfft2, out gets the rows x cols block
+		   starting from (first_row, first_col), row after row.
+		   The spectrum is used as work space.
+		*/
+		void irfft2(complex<T> *spectrum, int32_t P, int32_t Q, Span<T> out,
+				int32_t first_row, int32_t rows, int32_t first_col, int32_t cols){
+
+			int32_t width = Q/2+1;
+
+			this->columns(spectrum, P, width, 1);
+
+			for(int32_t r=0; r<rows; r++){
+				this->irfft(spectrum+(size_t)(first_row+r)*width, Q, out.subspan((size_t)r*cols, cols), first_col);
+			}
+		}
+
+		/*
+		   The work buffers of convolution (0 & 1), the digit
+		   reversal (2), Bluestein (3), the columns of the 2D
+		   transforms (4), the strided signals of batch (5)
+		   and four_step (6). Each thread has its own,
+		   they only grow, so once they've reached the largest size
+		   used, nothing is allocated.
+
+		   There's a set per level: the FFTs that run while a
+		   four_step waits get the next one. Adding a set moves
+		   the vectors, not their data, so pointers stay good.
+		*/
+		static complex<T> *scratch(int32_t which, int32_t size){
+			static thread_local vector<vector<complex<T> > > buffer;
+			size_t k = (size_t)level()*7+which;
+			if(buffer.size() <= k) buffer.resize(k-which+7);
+			if((int32_t)buffer[k].size() < size) buffer[k].resize(size);
+			return buffer[k].data();
+		}
+
+		static int32_t &level(){
+			static thread_local int32_t depth = 0;
+			return depth;
+		}
+
+		// the smallest length >= n the complex FFTs do without Bluestein.
+		int32_t fft_size(int32_t n){
+			return next_smooth(n);
+		}
+
+		/*
+		   The size of the FFTs of a convolution with n outputs:
+		   the smallest even size >= n whose half (the length of
+		   the complex FFTs) has no prime factors above 7. For
+		   2*784-1 = 1567 that's 1568 = 2*2^4*7^2 instead of 2048.
+		*/
+		int32_t transform_size(int32_t n){
+			return 2*next_smooth((n+1)/2);
+		}
+
+		/*
+		   The convolution of x and y (flipped first if inv1/inv2),
+		   as n long as with the version below, but only out.size()
+		   values starting from first are written into out.
+		   Nothing is allocated. Both inputs are real, so this
+		   runs on the half size real FFTs above.
+		*/
+		void convolution(
+				Span<const T> x, Span<const T> y, int32_t n, Span<T> out,
+				int32_t first = 0, bool inv1 = 0, bool inv2 = 0){
+
+			int32_t zx = x.size(), zy = y.size();
 			if(!n) n = zx+zy-1;
 			
 			n = std::max(n, zx);
 			n = std::max(n, zy);
-			
-			while(1<<b < n) b++;
 
-			B = std::max(B, b);
-			resize_precalc_tables();
+			int32_t size = this->transform_size(n), half = size/2;
+			complex<T> *cy = scratch(1, half+1);
 
-			vector<complex<T> > cx(1<<b, {0, 0}), cy(1<<b, {0, 0});
+			rfft(y, size, cy, inv2);
+			this->spectrum_convolution(x, Span<const complex<T> >(cy, half+1), size, out, first, inv1);
+		}
 
-			if(inv1) for(int32_t i=zx-1; i>=0; i--) cx[zx-1-i] = {x[i], 0};
-			else for(int32_t i=0; i<zx; i++) cx[i] = {x[i], 0};
-			
-			if(inv2) for(int32_t i=zy-1; i>=0; i--) cy[zy-1-i] = {y[i], 0};
-			else for(int32_t i=0; i<zy; i++) cy[i] = {y[i], 0};
+		/*
+		   When one side of many convolutions stays the same (a
+		   filter), its transform can be done once with spectrum
+		   and then used with spectrum_convolution, which is the
+		   convolution above minus one of the three FFTs.
+		   n is the convolution size as above, the spectrum
+		   must come from spectrum with the same n.
+		*/
+		void spectrum(Span<const T> y, int32_t n, vector<complex<T> > &out, bool inv = 0){
+			n = std::max(n, (int32_t)y.size());
+			int32_t size = this->transform_size(n);
+			out.resize(size/2+1);
+			rfft(y, size, out.data(), inv);
+		}
+
+		void spectrum_convolution(
+				Span<const T> x, Span<const complex<T> > spectrum_y, int32_t n, Span<T> out,
+				int32_t first = 0, bool inv1 = 0){
+
+			int32_t size = this->transform_size(std::max(n, (int32_t)x.size())), half = size/2;
+			complex<T> *cx = scratch(0, half+1);
 
-			fft(cx);
-			fft(cy);
+			rfft(x, size, cx, inv1);
 
 			// clalculating convolution
-			for(int32_t i=0; i<(1<<b); i++) cx[i] *= cy[i];
+			for(int32_t i=0; i<=half; i++) cx[i] *= spectrum_y[i];
 
-			// inverse
-			fft(cx);
-			std::reverse(cx.begin()+1, cx.end());
-			vector<T> xy(n);
-			for(int32_t i=0; i<n; i++) xy[i] = cx[i].real()/(T)(1<<b);
+			irfft(cx, size, out, first);
+		}
 
+		// the convolution of two signals from their spectra, spectrum_x is used as work space.
+		void spectra_convolution(
+				complex<T> *spectrum_x, Span<const complex<T> > spectrum_y, int32_t size, Span<T> out,
+				int32_t first = 0){
+			for(int32_t i=0; i<=size/2; i++) spectrum_x[i] *= spectrum_y[i];
+			irfft(spectrum_x, size, out, first);
+		}
+
+		/*
+		   spectrum_convolution for count signals x+b*x_stride (zx
+		   long each) with the same spectrum_y, len values of result
+		   b go to out+b*out_stride. The transforms are batched and
+		   spectrum_y is multiplied with a group of spectra at a time.
+		*/
+		void spectrum_convolution_batch(
+				const T *x, int32_t zx, size_t x_stride, int32_t count,
+				Span<const complex<T> > spectrum_y, int32_t n,
+				T *out, int32_t len, size_t out_stride, int32_t first = 0){
+
+			int32_t size = this->transform_size(std::max(n, zx)), bins = size/2+1;
+			complex<T> *cx = scratch(0, bins*std::min(count, FFT_BATCH_GROUP));
+
+			for(int32_t b=0; b<count; b+=FFT_BATCH_GROUP){
+				int32_t group = std::min(FFT_BATCH_GROUP, count-b);
+				this->rfft_batch(x+(size_t)b*x_stride, zx, x_stride, group, size, cx);
+				this->spectra_convolution_batch(cx, group, spectrum_y, size, out+(size_t)b*out_stride, len, out_stride, first);
+			}
+		}
+
+		// spectra_convolution for count spectra in a row, they're used as work space.
+		void spectra_convolution_batch(
+				complex<T> *spectra_x, int32_t count, Span<const complex<T> > spectrum_y, int32_t size,
+				T *out, int32_t len, size_t out_stride, int32_t first = 0){
+
+			int32_t bins = size/2+1;
+
+			for(int32_t b=0; b<count; b++){
+				complex<T> *cx = spectra_x+(size_t)b*bins;
+				for(int32_t i=0; i<bins; i++) cx[i] = mul(cx[i], spectrum_y[i]);
+			}
+			this->irfft_batch(spectra_x, size, count, out, len, out_stride, first);
+		}
+
+		/*
+		   Turns the spectrum of x (zx long) into the spectrum of x
+		   flipped. x flipped is x[zx-1-i], so each value k becomes
+		   w^((zx-1)*k)*conj(X[k]), w = e^(i*2pi/size).
+		*/
+		void flip_spectrum(complex<T> *spectrum, int32_t zx, int32_t size){
+
+			int32_t half = size/2;
+
+			const vector<complex<T> > &tw = this->plan(half)->root;
+
+			for(int32_t k=0; k<=half; k++){
+				int32_t t = (int32_t)((int64_t)(zx-1)*k%size);
+				complex<T> wt = t < half ? tw[t] : -tw[t-half];
+				spectrum[k] = wt*std::conj(spectrum[k]);
+			}
+		}
+
+		vector<T> convolution(
+				Span<const T> x, Span<const T> y,
+				int32_t n=0, bool inv1=0, bool inv2=0){
+
+			if(!n) n = x.size()+y.size()-1;
+			n = std::max(n, (int32_t)x.size());
+			n = std::max(n, (int32_t)y.size());
+
+			vector<T> xy(n);
+			this->convolution(x, y, n, xy, 0, inv1, inv2);
 			return xy;
 		}
 };
@@ -0,0 +1,339 @@
+#ifndef GEMM_HPP_
+#define GEMM_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "kernels.hpp"
+
+using std::vector;
+
+namespace gemm{
+
+	/*
+	   General matrix multiplication, all matrices row-major:
+
+	   C = alpha*op(A)*op(B) + beta*C
+
+	   op(A) is M x K, op(B) is K x N and C is M x N.
+	   op(X) is X or the transpose of X, depending on the
+	   Op given for it. The leading dimensions lda, ldb & ldc
+	   are the distances between consecutive rows as stored.
+
+	   The implementation is the usual one for fast GEMM
+	   (Goto's algorithm, as in BLIS / OpenBLAS):
+
+	   for each NC wide column block of C:
+	     for each KC deep slice of the sum:
+	       pack the KC x NC block of op(B) into NR wide panels (stays in L3/L2)
+	       for each MC tall row block of C:
+	         pack the MC x KC block of op(A) into MR tall panels (stays in L2)
+	         for each NR wide panel of B, for each MR tall panel of A:
+	           micro-kernel: MR x NR block of C += A panel * B panel
+
+	   The micro-kernel keeps its MR x NR block of C in
+	   registers for the whole KC deep sum and streams
+	   the packed panels from L1. Packing also takes care of
+	   the transposes and of zero padding at the edges, so
+	   the micro-kernel only ever sees one shape.
+
+	   float and double have SSE2, AVX2 and AVX-512 micro-kernels,
+	   picked at runtime like the kernels in func/kernels.
+	   Other types use a plain loop version.
+	*/
+
+	enum Op{
+		NO_TRANS = 0,
+		TRANS = 1
+	};
+
+	// block sizes in elements: KC deep slices, MC tall & NC wide blocks.
+	const int32_t GEMM_KC = 256;
+	const int32_t GEMM_MC = 96;
+	const int32_t GEMM_NC = 2048;
+
+	template<class T> void reference(
+			Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+			T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+			T beta, T *C, int32_t ldc){
+
+		// plain loops, the i-p-j order keeps the inner loop on rows of C.
+
+		vector<T> row(N);
+
+		for(int32_t i=0; i<M; i++){
+			std::fill(row.begin(), row.end(), (T)0);
+			for(int32_t p=0; p<K; p++){
+				T a = ta == NO_TRANS ? A[(size_t)i*lda+p] : A[(size_t)p*lda+i];
+				if(tb == NO_TRANS){
+					const T *b = B+(size_t)p*ldb;
+					for(int32_t j=0; j<N; j++) row[j] += a*b[j];
+				} else {
+					for(int32_t j=0; j<N; j++) row[j] += a*B[(size_t)j*ldb+p];
+				}
+			}
+			T *c = C+(size_t)i*ldc;
+			for(int32_t j=0; j<N; j++){
+				c[j] = beta == (T)0 ? alpha*row[j] : alpha*row[j]+beta*c[j];
+			}
+		}
+	}
+
+	// per thread scratch for the packed panels, aligned to 64 bytes.
+	template<class T> T *pack_buffer(int32_t which, size_t size){
+		static thread_local vector<T> buffer[2];
+		const size_t pad = 64/sizeof(T)+1;
+		if(buffer[which].size() < size+pad) buffer[which].resize(size+pad);
+		uintptr_t p = (uintptr_t)buffer[which].data();
+		return (T*)((p+63)/64*64);
+	}
+
+	// MR tall panels of op(A) rows [i0, i0+mc), sum index [p0, p0+kc).
+	template<class T, int32_t MR> void pack_a(
+			Op ta, const T *A, int32_t lda, int32_t i0, int32_t mc, int32_t p0, int32_t kc, T *out){
+
+		for(int32_t ir=0; ir<mc; ir+=MR){
+			int32_t mr = std::min(MR, mc-ir);
+			for(int32_t p=0; p<kc; p++){
+				for(int32_t r=0; r<mr; r++){
+					int32_t i = i0+ir+r, k = p0+p;
+					out[r] = ta == NO_TRANS ? A[(size_t)i*lda+k] : A[(size_t)k*lda+i];
+				}
+				for(int32_t r=mr; r<MR; r++) out[r] = (T)0;
+				out += MR;
+			}
+		}
+	}
+
+	// NR wide panels of op(B) columns [j0, j0+nc), sum index [p0, p0+kc).
+	template<class T, int32_t NR> void pack_b(
+			Op tb, const T *B, int32_t ldb, int32_t j0, int32_t nc, int32_t p0, int32_t kc, T *out){
+
+		for(int32_t jr=0; jr<nc; jr+=NR){
+			int32_t nr = std::min(NR, nc-jr);
+			for(int32_t p=0; p<kc; p++){
+				int32_t k = p0+p;
+				if(tb == NO_TRANS){
+					const T *b = B+(size_t)k*ldb+j0+jr;
+					for(int32_t j=0; j<nr; j++) out[j] = b[j];
+				} else {
+					for(int32_t j=0; j<nr; j++) out[j] = B[(size_t)(j0+jr+j)*ldb+k];
+				}
+				for(int32_t j=nr; j<NR; j++) out[j] = (T)0;
+				out += NR;
+			}
+		}
+	}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define CAKE_INLINE inline __attribute__((always_inline))
+
+	namespace simd{
+
+		using kernels::simd::load;
+		using kernels::simd::store;
+		using kernels::simd::broadcast;
+
+		/*
+		   MR x NR block of C, NR = NV vectors of L lanes.
+		   mr & nr are the parts of the block that are inside C.
+		   first tells whether beta still has to be applied,
+		   later KC slices just add on top.
+		*/
+		template<class T, class V, int32_t MR, int32_t NV> CAKE_INLINE void micro_kernel(
+				int32_t kc, const T *a, const T *b, T *c, int32_t ldc,
+				int32_t mr, int32_t nr, T alpha, T beta, bool first){
+
+			const int32_t L = sizeof(V)/sizeof(T), NR = NV*L;
+
+			V acc[MR][NV], bv[NV], av;
+
+			#pragma GCC unroll 16
+			for(int32_t r=0; r<MR; r++){
+				#pragma GCC unroll 4
+				for(int32_t v=0; v<NV; v++) broadcast(acc[r][v], (T)0);
+			}
+
+			for(int32_t p=0; p<kc; p++){
+				#pragma GCC unroll 4
+				for(int32_t v=0; v<NV; v++) load(bv[v], b+v*L);
+				#pragma GCC unroll 16
+				for(int32_t r=0; r<MR; r++){
+					broadcast(av, a[r]);
+					#pragma GCC unroll 4
+					for(int32_t v=0; v<NV; v++) acc[r][v] += av*bv[v];
+				}
+				a += MR;
+				b += NR;
+			}
+
+			if(mr == MR && nr == NR){
+				V va, vb, vc;
+				broadcast(va, alpha);
+				broadcast(vb, first ? beta : (T)1);
+				bool add = !first || beta != (T)0;
+				#pragma GCC unroll 16
+				for(int32_t r=0; r<MR; r++){
+					#pragma GCC unroll 4
+					for(int32_t v=0; v<NV; v++){
+						T *cp = c+(size_t)r*ldc+v*L;
+						if(add){
+							load(vc, cp);
+							vc = va*acc[r][v]+vb*vc;
+						} else vc = va*acc[r][v];
+						store(cp, vc);
+					}
+				}
+			} else {
+				T tile[MR*NR];
+				for(int32_t r=0; r<MR; r++){
+					for(int32_t v=0; v<NV; v++) store(tile+r*NR+v*L, acc[r][v]);
+				}
+				for(int32_t r=0; r<mr; r++){
+					T *cp = c+(size_t)r*ldc;
+					for(int32_t j=0; j<nr; j++){
+						if(!first) cp[j] += alpha*tile[r*NR+j];
+						else if(beta == (T)0) cp[j] = alpha*tile[r*NR+j];
+						else cp[j] = alpha*tile[r*NR+j]+beta*cp[j];
+					}
+				}
+			}
+		}
+
+		template<class T, class V, int32_t MR, int32_t NV> CAKE_INLINE void blocked(
+				Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+				T beta, T *C, int32_t ldc){
+
+			const int32_t L = sizeof(V)/sizeof(T), NR = NV*L;
+			const int32_t MC = (GEMM_MC+MR-1)/MR*MR, NC = (GEMM_NC+NR-1)/NR*NR;
+
+			T *pa = pack_buffer<T>(0, (size_t)MC*GEMM_KC);
+			T *pb = pack_buffer<T>(1, (size_t)NC*GEMM_KC);
+
+			for(int32_t jc=0; jc<N; jc+=NC){
+				int32_t nc = std::min(NC, N-jc);
+				for(int32_t pc=0; pc<K; pc+=GEMM_KC){
+					int32_t kc = std::min(GEMM_KC, K-pc);
+					pack_b<T, NR>(tb, B, ldb, jc, nc, pc, kc, pb);
+					for(int32_t ic=0; ic<M; ic+=MC){
+						int32_t mc = std::min(MC, M-ic);
+						pack_a<T, MR>(ta, A, lda, ic, mc, pc, kc, pa);
+						for(int32_t jr=0; jr<nc; jr+=NR){
+							for(int32_t ir=0; ir<mc; ir+=MR){
+								micro_kernel<T, V, MR, NV>(
+									kc, pa+(size_t)ir*kc, pb+(size_t)jr*kc,
+									C+(size_t)(ic+ir)*ldc+jc+jr, ldc,
+									std::min(MR, mc-ir), std::min(NR, nc-jr),
+									alpha, beta, pc == 0);
+							}
+						}
+					}
+				}
+			}
+		}
+
+		using kernels::simd::f32x4;
+		using kernels::simd::f32x8;
+		using kernels::simd::f32x16;
+		using kernels::simd::f64x2;
+		using kernels::simd::f64x4;
+		using kernels::simd::f64x8;
+
+		// MR rows x NV vectors of accumulators, sized to the register file of each ISA.
+#define CAKE_GEMM_SET(ISA, TARGET, T, V, MR, NV) \
+		namespace ISA{ \
+			__attribute__((target(TARGET))) inline void gemm(Op ta, Op tb, int32_t M, int32_t N, int32_t K, \
+					T alpha, const T *A, int32_t lda, const T *B, int32_t ldb, T beta, T *C, int32_t ldc){ \
+				blocked<T, V, MR, NV>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc); } \
+		}
+
+		CAKE_GEMM_SET(sse2, "sse2", float, f32x4, 4, 2)
+		CAKE_GEMM_SET(sse2, "sse2", double, f64x2, 4, 2)
+		CAKE_GEMM_SET(avx2, "avx2,fma", float, f32x8, 6, 2)
+		CAKE_GEMM_SET(avx2, "avx2,fma", double, f64x4, 6, 2)
+		CAKE_GEMM_SET(avx512, "avx512f", float, f32x16, 12, 2)
+		CAKE_GEMM_SET(avx512, "avx512f", double, f64x8, 12, 2)
+
+#undef CAKE_GEMM_SET
+
+		template<class T> void dispatch(
+				Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+				T beta, T *C, int32_t ldc){
+			switch(kernels::active_isa()){
+				case kernels::ISA_AVX512:
+					avx512::gemm(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+					break;
+				case kernels::ISA_AVX2:
+					avx2::gemm(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+					break;
+				case kernels::ISA_SSE2:
+					sse2::gemm(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+					break;
+				default:
+					reference<T>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+			}
+		}
+	}
+
+#undef CAKE_INLINE
+
+	template<class T> struct Dispatch{
+		static void gemm(Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+				T beta, T *C, int32_t ldc){
+			reference<T>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+		}
+	};
+
+	template<> struct Dispatch<float>{
+		static void gemm(Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				float alpha, const float *A, int32_t lda, const float *B, int32_t ldb,
+				float beta, float *C, int32_t ldc){
+			simd::dispatch<float>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+		}
+	};
+
+	template<> struct Dispatch<double>{
+		static void gemm(Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				double alpha, const double *A, int32_t lda, const double *B, int32_t ldb,
+				double beta, double *C, int32_t ldc){
+			simd::dispatch<double>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+		}
+	};
+
+#else
+
+	template<class T> struct Dispatch{
+		static void gemm(Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+				T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+				T beta, T *C, int32_t ldc){
+			reference<T>(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+		}
+	};
+
+#endif
+
+	template<class T> void gemm(
+			Op ta, Op tb, int32_t M, int32_t N, int32_t K,
+			T alpha, const T *A, int32_t lda, const T *B, int32_t ldb,
+			T beta, T *C, int32_t ldc){
+
+		if(M <= 0 || N <= 0) return;
+
+		if(K <= 0){
+			for(int32_t i=0; i<M; i++){
+				T *c = C+(size_t)i*ldc;
+				for(int32_t j=0; j<N; j++) c[j] = beta == (T)0 ? (T)0 : beta*c[j];
+			}
+			return;
+		}
+
+		Dispatch<T>::gemm(ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+	}
+}
+
+#endif
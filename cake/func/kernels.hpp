@@ -0,0 +1,322 @@
+#ifndef KERNELS_HPP_
+#define KERNELS_HPP_
+
+#include <algorithm>
+#include <cstdint>
+
+namespace kernels{
+
+	/*
+	   Vector kernels for the matrix layers.
+
+	   axpy:   y[j] += a*x[j]
+	   dot:    returns sum_j x[j]*y[j]
+	   gemv:   y[j] += sum_i A[i*ld+j]*x[i]   (rows x cols, row i starts at A+i*ld)
+	   gemv_t: x[i] += sum_j A[i*ld+j]*y[j]
+	   ger:    A[i*ld+j] += a*x[i]*y[j]
+
+	   float and double have SSE2, AVX2 and AVX-512 versions.
+	   The widest one the host supports is chosen the first time
+	   a kernel is called (cpuid via __builtin_cpu_supports),
+	   so the same binary runs on every x86-64 machine.
+	   Other types and other architectures use the scalar versions.
+
+	   The SIMD versions are all the same template bodies, built
+	   with GCC vector extensions. They are force-inlined into small
+	   wrappers compiled with a target attribute, which makes
+	   the compiler emit the instructions of that ISA.
+	*/
+
+	enum Isa{
+		ISA_SCALAR = 0,
+		ISA_SSE2 = 1,
+		ISA_AVX2 = 2,
+		ISA_AVX512 = 3
+	};
+
+	inline Isa detect_isa(){
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) return ISA_AVX512;
+		if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return ISA_AVX2;
+		if(__builtin_cpu_supports("sse2")) return ISA_SSE2;
+#endif
+		return ISA_SCALAR;
+	}
+
+	inline Isa active_isa(){
+		static const Isa isa = detect_isa();
+		return isa;
+	}
+
+	inline const char *isa_name(Isa isa = active_isa()){
+		switch(isa){
+			case ISA_SSE2: return "sse2";
+			case ISA_AVX2: return "avx2";
+			case ISA_AVX512: return "avx512";
+			default: return "scalar";
+		}
+	}
+
+	template<class T> struct Table{
+		void (*axpy)(int32_t, T, const T*, T*);
+		T (*dot)(int32_t, const T*, const T*);
+		void (*gemv)(int32_t, int32_t, const T*, int32_t, const T*, T*);
+		void (*gemv_t)(int32_t, int32_t, const T*, int32_t, const T*, T*);
+		void (*ger)(int32_t, int32_t, T*, int32_t, T, const T*, const T*);
+	};
+
+	namespace scalar{
+
+		template<class T> void axpy(int32_t n, T a, const T *x, T *y){
+			for(int32_t j=0; j<n; j++) y[j] += a*x[j];
+		}
+
+		template<class T> T dot(int32_t n, const T *x, const T *y){
+			T sum = (T)0;
+			for(int32_t j=0; j<n; j++) sum += x[j]*y[j];
+			return sum;
+		}
+
+		template<class T> void gemv(int32_t rows, int32_t cols, const T *A, int32_t ld, const T *x, T *y){
+			for(int32_t i=0; i<rows; i++) axpy<T>(cols, x[i], A+(size_t)i*ld, y);
+		}
+
+		template<class T> void gemv_t(int32_t rows, int32_t cols, const T *A, int32_t ld, const T *y, T *x){
+			for(int32_t i=0; i<rows; i++) x[i] += dot<T>(cols, A+(size_t)i*ld, y);
+		}
+
+		template<class T> void ger(int32_t rows, int32_t cols, T *A, int32_t ld, T a, const T *x, const T *y){
+			for(int32_t i=0; i<rows; i++) axpy<T>(cols, a*x[i], y, A+(size_t)i*ld);
+		}
+
+		template<class T> Table<T> table(){
+			return {axpy<T>, dot<T>, gemv<T>, gemv_t<T>, ger<T>};
+		}
+	}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define CAKE_INLINE inline __attribute__((always_inline))
+
+	namespace simd{
+
+		/*
+		   V is a GCC vector type of T, L = lanes in V.
+		   Vectors are only passed by reference, by value they'd
+		   fall under a different calling convention per ISA.
+		*/
+
+		template<class V, class T> CAKE_INLINE void load(V &r, const T *p){
+			__builtin_memcpy(&r, p, sizeof(V));
+		}
+
+		template<class V, class T> CAKE_INLINE void store(T *p, const V &v){
+			__builtin_memcpy(p, &v, sizeof(V));
+		}
+
+		template<class V, class T> CAKE_INLINE void broadcast(V &r, T a){
+			const int32_t L = sizeof(V)/sizeof(T);
+			for(int32_t k=0; k<L; k++) r[k] = a;
+		}
+
+		template<class V, class T> CAKE_INLINE T hsum(const V &v){
+			const int32_t L = sizeof(V)/sizeof(T);
+			T sum = (T)0;
+			for(int32_t k=0; k<L; k++) sum += v[k];
+			return sum;
+		}
+
+		template<class V, class T> CAKE_INLINE void axpy(int32_t n, T a, const T *x, T *y){
+			const int32_t L = sizeof(V)/sizeof(T);
+			V va, x0, x1, y0, y1;
+			broadcast(va, a);
+			int32_t j = 0;
+			for(; j+2*L<=n; j+=2*L){
+				load(x0, x+j);
+				load(x1, x+j+L);
+				load(y0, y+j);
+				load(y1, y+j+L);
+				y0 += va*x0;
+				y1 += va*x1;
+				store(y+j, y0);
+				store(y+j+L, y1);
+			}
+			for(; j+L<=n; j+=L){
+				load(x0, x+j);
+				load(y0, y+j);
+				y0 += va*x0;
+				store(y+j, y0);
+			}
+			for(; j<n; j++) y[j] += a*x[j];
+		}
+
+		template<class V, class T> CAKE_INLINE T dot(int32_t n, const T *x, const T *y){
+			const int32_t L = sizeof(V)/sizeof(T);
+			V s0 = {}, s1 = {}, x0, x1, y0, y1;
+			int32_t j = 0;
+			for(; j+2*L<=n; j+=2*L){
+				load(x0, x+j);
+				load(x1, x+j+L);
+				load(y0, y+j);
+				load(y1, y+j+L);
+				s0 += x0*y0;
+				s1 += x1*y1;
+			}
+			for(; j+L<=n; j+=L){
+				load(x0, x+j);
+				load(y0, y+j);
+				s0 += x0*y0;
+			}
+			s0 += s1;
+			T sum = hsum<V, T>(s0);
+			for(; j<n; j++) sum += x[j]*y[j];
+			return sum;
+		}
+
+		template<class V, class T> CAKE_INLINE void gemv(
+				int32_t rows, int32_t cols, const T *A, int32_t ld, const T *x, T *y){
+
+			// 4 rows per pass over y, so y is loaded & stored 4x less often.
+
+			const int32_t L = sizeof(V)/sizeof(T);
+			int32_t i = 0;
+			for(; i+4<=rows; i+=4){
+				const T *a0 = A+(size_t)i*ld, *a1 = a0+ld, *a2 = a1+ld, *a3 = a2+ld;
+				V x0, x1, x2, x3, vy, va;
+				broadcast(x0, x[i]);
+				broadcast(x1, x[i+1]);
+				broadcast(x2, x[i+2]);
+				broadcast(x3, x[i+3]);
+				int32_t j = 0;
+				for(; j+L<=cols; j+=L){
+					load(vy, y+j);
+					load(va, a0+j); vy += x0*va;
+					load(va, a1+j); vy += x1*va;
+					load(va, a2+j); vy += x2*va;
+					load(va, a3+j); vy += x3*va;
+					store(y+j, vy);
+				}
+				for(; j<cols; j++) y[j] += x[i]*a0[j] + x[i+1]*a1[j] + x[i+2]*a2[j] + x[i+3]*a3[j];
+			}
+			for(; i<rows; i++) axpy<V, T>(cols, x[i], A+(size_t)i*ld, y);
+		}
+
+		template<class V, class T> CAKE_INLINE void gemv_t(
+				int32_t rows, int32_t cols, const T *A, int32_t ld, const T *y, T *x){
+
+			// 4 rows per pass over y, each with its own accumulator.
+
+			const int32_t L = sizeof(V)/sizeof(T);
+			int32_t i = 0;
+			for(; i+4<=rows; i+=4){
+				const T *a0 = A+(size_t)i*ld, *a1 = a0+ld, *a2 = a1+ld, *a3 = a2+ld;
+				V s0 = {}, s1 = {}, s2 = {}, s3 = {}, vy, va;
+				int32_t j = 0;
+				for(; j+L<=cols; j+=L){
+					load(vy, y+j);
+					load(va, a0+j); s0 += va*vy;
+					load(va, a1+j); s1 += va*vy;
+					load(va, a2+j); s2 += va*vy;
+					load(va, a3+j); s3 += va*vy;
+				}
+				T r0 = hsum<V, T>(s0), r1 = hsum<V, T>(s1), r2 = hsum<V, T>(s2), r3 = hsum<V, T>(s3);
+				for(; j<cols; j++){
+					r0 += a0[j]*y[j];
+					r1 += a1[j]*y[j];
+					r2 += a2[j]*y[j];
+					r3 += a3[j]*y[j];
+				}
+				x[i] += r0;
+				x[i+1] += r1;
+				x[i+2] += r2;
+				x[i+3] += r3;
+			}
+			for(; i<rows; i++) x[i] += dot<V, T>(cols, A+(size_t)i*ld, y);
+		}
+
+		template<class V, class T> CAKE_INLINE void ger(
+				int32_t rows, int32_t cols, T *A, int32_t ld, T a, const T *x, const T *y){
+			for(int32_t i=0; i<rows; i++) axpy<V, T>(cols, a*x[i], y, A+(size_t)i*ld);
+		}
+
+		typedef float f32x4 __attribute__((vector_size(16)));
+		typedef float f32x8 __attribute__((vector_size(32)));
+		typedef float f32x16 __attribute__((vector_size(64)));
+		typedef double f64x2 __attribute__((vector_size(16)));
+		typedef double f64x4 __attribute__((vector_size(32)));
+		typedef double f64x8 __attribute__((vector_size(64)));
+
+#define CAKE_KERNEL_SET(ISA, TARGET, T, V) \
+		namespace ISA{ \
+			__attribute__((target(TARGET))) inline void axpy(int32_t n, T a, const T *x, T *y){ \
+				simd::axpy<V, T>(n, a, x, y); } \
+			__attribute__((target(TARGET))) inline T dot(int32_t n, const T *x, const T *y){ \
+				return simd::dot<V, T>(n, x, y); } \
+			__attribute__((target(TARGET))) inline void gemv(int32_t r, int32_t c, const T *A, int32_t ld, const T *x, T *y){ \
+				simd::gemv<V, T>(r, c, A, ld, x, y); } \
+			__attribute__((target(TARGET))) inline void gemv_t(int32_t r, int32_t c, const T *A, int32_t ld, const T *y, T *x){ \
+				simd::gemv_t<V, T>(r, c, A, ld, y, x); } \
+			__attribute__((target(TARGET))) inline void ger(int32_t r, int32_t c, T *A, int32_t ld, T a, const T *x, const T *y){ \
+				simd::ger<V, T>(r, c, A, ld, a, x, y); } \
+			inline Table<T> table(T){ return {axpy, dot, gemv, gemv_t, ger}; } \
+		}
+
+		CAKE_KERNEL_SET(sse2, "sse2", float, f32x4)
+		CAKE_KERNEL_SET(sse2, "sse2", double, f64x2)
+		CAKE_KERNEL_SET(avx2, "avx2,fma", float, f32x8)
+		CAKE_KERNEL_SET(avx2, "avx2,fma", double, f64x4)
+		CAKE_KERNEL_SET(avx512, "avx512f", float, f32x16)
+		CAKE_KERNEL_SET(avx512, "avx512f", double, f64x8)
+
+#undef CAKE_KERNEL_SET
+
+		template<class T> Table<T> select_table(){
+			switch(active_isa()){
+				case ISA_AVX512: return avx512::table((T)0);
+				case ISA_AVX2: return avx2::table((T)0);
+				case ISA_SSE2: return sse2::table((T)0);
+				default: return scalar::table<T>();
+			}
+		}
+	}
+
+#undef CAKE_INLINE
+
+	template<class T> Table<T> select_table(){ return scalar::table<T>(); }
+	template<> inline Table<float> select_table<float>(){ return simd::select_table<float>(); }
+	template<> inline Table<double> select_table<double>(){ return simd::select_table<double>(); }
+
+#else
+
+	template<class T> Table<T> select_table(){ return scalar::table<T>(); }
+
+#endif
+
+	template<class T> const Table<T> &table(){
+		static const Table<T> t = select_table<T>();
+		return t;
+	}
+
+	template<class T> void axpy(int32_t n, T a, const T *x, T *y){
+		table<T>().axpy(n, a, x, y);
+	}
+
+	template<class T> T dot(int32_t n, const T *x, const T *y){
+		return table<T>().dot(n, x, y);
+	}
+
+	template<class T> void gemv(int32_t rows, int32_t cols, const T *A, int32_t ld, const T *x, T *y){
+		table<T>().gemv(rows, cols, A, ld, x, y);
+	}
+
+	template<class T> void gemv_t(int32_t rows, int32_t cols, const T *A, int32_t ld, const T *y, T *x){
+		table<T>().gemv_t(rows, cols, A, ld, y, x);
+	}
+
+	template<class T> void ger(int32_t rows, int32_t cols, T *A, int32_t ld, T a, const T *x, const T *y){
+		table<T>().ger(rows, cols, A, ld, a, x, y);
+	}
+}
+
+#endif
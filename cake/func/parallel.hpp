@@ -0,0 +1,152 @@
+#ifndef PARALLEL_HPP_
+#define PARALLEL_HPP_
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+#include "thread-pool.hpp"
+
+using std::vector;
+
+namespace parallel{
+
+	/*
+	   All the parallel jobs of the library run on one shared
+	   work-stealing pool (func/thread-pool), so jobs started
+	   from inside other jobs don't add threads, they just add
+	   tasks that the same threads pick up.
+	*/
+
+	// jobs smaller than this many basic operations aren't split between threads.
+	const int64_t SPLIT_THRESHOLD = 1<<20;
+
+	inline std::unique_ptr<ThreadPool> &pool_slot(){
+		static std::unique_ptr<ThreadPool> slot;
+		return slot;
+	}
+
+	inline int32_t &thread_setting(){
+		static int32_t count = std::max(1, (int32_t)std::thread::hardware_concurrency());
+		return count;
+	}
+
+	// the shared pool, started on first use.
+	inline ThreadPool &pool(){
+		std::unique_ptr<ThreadPool> &slot = pool_slot();
+		if(!slot) slot.reset(new ThreadPool(thread_setting()));
+		return *slot;
+	}
+
+	// how many threads the pool uses, the hardware thread count by default.
+	inline int32_t thread_count(){
+		return thread_setting();
+	}
+
+	// Restarts the pool with count threads, nothing may be running on it.
+	inline void set_thread_count(int32_t count){
+		count = std::max(1, count);
+		if(count == thread_setting()) return;
+		thread_setting() = count;
+		pool_slot().reset();
+	}
+
+	// Stops the pool's threads, the next job starts it again.
+	inline void shutdown(){
+		pool_slot().reset();
+	}
+
+	/*
+	   Calls f(begin, end) on pieces of [begin, end) that together
+	   cover it, none longer than grain, in parallel. The range
+	   is halved recursively, one half forked as a task and the
+	   other done right away, so idle threads steal big pieces
+	   and the forking thread works through small ones.
+	*/
+	template<class F> void parallel_for(int32_t begin, int32_t end, int32_t grain, const F &f){
+
+		grain = std::max(1, grain);
+		if(end-begin <= grain){
+			if(begin < end) f(begin, end);
+			return;
+		}
+
+		int32_t middle = begin+(end-begin)/2;
+
+		TaskGroup group(&pool());
+		auto upper = [&, middle, end, grain]{ parallel_for(middle, end, grain, f); };
+		FunctionTask<decltype(upper)> task(upper);
+		group.spawn(&task);
+		parallel_for(begin, middle, grain, f);
+		group.wait();
+	}
+
+	// Runs f(k) for k = 0, 1, ..., count-1 as tasks on the pool.
+	// f(0) runs on the calling thread. Returns once all are done.
+	template<class F> void run(int32_t count, const F &f){
+		if(count <= 1){
+			if(count == 1) f(0);
+			return;
+		}
+		parallel_for(0, count, 1, [&](int32_t a, int32_t b){
+			for(int32_t k=a; k<b; k++) f(k);
+		});
+	}
+
+	/*
+	   Runs f(k) for k = 0, 1, ..., count-1 each on its own new
+	   thread, f(0) on the calling one. For jobs whose parts must
+	   all be running at the same time, like pipeline stages
+	   waiting on each other, which the pool doesn't promise.
+	*/
+	template<class F> void concurrent(int32_t count, const F &f){
+		vector<std::thread> threads;
+		for(int32_t k=1; k<count; k++) threads.emplace_back([&f, k]{ f(k); });
+		if(count > 0) f(0);
+		for(auto &i : threads) i.join();
+	}
+
+	/*
+	   Splits the range [0, size) into thread_count() parts
+	   and calls f(begin, end) for each part, if the job is big
+	   enough to be worth it (work = total basic operations).
+	   Otherwise it just calls f(0, size). The part boundaries
+	   are multiples of align, so that parts don't share cache
+	   lines or SIMD vectors.
+	*/
+	template<class F> void split(int32_t size, int64_t work, const F &f, int32_t align = 16){
+
+		int32_t parts = std::min(thread_count(), (size+align-1)/align);
+
+		if(work < SPLIT_THRESHOLD || parts <= 1){
+			f(0, size);
+			return;
+		}
+
+		run(parts, [&](int32_t k){
+			int32_t begin = (int32_t)((int64_t)size*k/parts)/align*align;
+			int32_t end = k == parts-1 ? size : (int32_t)((int64_t)size*(k+1)/parts)/align*align;
+			if(begin < end) f(begin, end);
+		});
+	}
+
+	/*
+	   Combines count things into the 0th one, combine(a, b) should
+	   merge b into a. The merges run as a tree: first 1 into 0,
+	   3 into 2, ..., then 2 into 0, 6 into 4, ... with the merges of
+	   each round running in parallel, log2(count) rounds in total.
+	*/
+	template<class F> void tree_reduce(int32_t count, const F &combine){
+		for(int32_t step=1; step<count; step*=2){
+			int32_t pairs = (count-step+2*step-1)/(2*step);
+			run(pairs, [&](int32_t k){
+				int32_t a = 2*step*k;
+				combine(a, a+step);
+			});
+		}
+	}
+}
+
+#endif
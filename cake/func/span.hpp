@@ -0,0 +1,60 @@
+#ifndef SPAN_HPP_
+#define SPAN_HPP_
+
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+using std::vector;
+
+template<class T> class Span{
+
+	/*
+	   A borrowed view of n consecutive T's somewhere else,
+	   what std::span is in C++20. Passing one around copies
+	   a pointer and a size, never the data.
+
+	   Anything with data() and size() (a vector, another Span)
+	   turns into a Span by itself, and Span<const T> turns
+	   back into a vector<T> when one is asked for, so code
+	   written for vectors keeps working. The viewed data
+	   must outlive the Span.
+	*/
+
+	protected:
+
+		T *ptr = NULL;
+		size_t count = 0;
+
+	public:
+
+		typedef typename std::remove_const<T>::type value_type;
+
+		Span(){}
+
+		Span(T *ptr_, size_t count_) : ptr(ptr_), count(count_){}
+
+		template<class V, class = typename std::enable_if<
+				std::is_convertible<decltype(std::declval<V&>().data()), T*>::value>::type>
+		Span(V &&other) : ptr(other.data()), count(other.size()){}
+
+		T *data() const { return this->ptr; }
+		size_t size() const { return this->count; }
+		bool empty() const { return this->count == 0; }
+
+		T *begin() const { return this->ptr; }
+		T *end() const { return this->ptr+this->count; }
+
+		T &operator[](size_t i) const { return this->ptr[i]; }
+
+		Span<T> subspan(size_t offset, size_t count_) const {
+			return Span<T>(this->ptr+offset, count_);
+		}
+
+		operator vector<value_type>() const {
+			return vector<value_type>(this->begin(), this->end());
+		}
+};
+
+#endif
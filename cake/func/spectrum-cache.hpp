@@ -0,0 +1,191 @@
+#ifndef SPECTRUM_CACHE_HPP_
+#define SPECTRUM_CACHE_HPP_
+
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "fft.hpp"
+#include "parallel.hpp"
+
+using std::vector;
+using std::complex;
+
+/*
+   IEEE half precision (1 sign, 5 exponent & 10 mantissa bits),
+   converted by hand since C++17 has no half type.
+   Rounds to nearest, too large values become infinity and
+   too small ones become subnormals or 0.
+*/
+inline uint16_t float_to_half(float f){
+
+	uint32_t x;
+	memcpy(&x, &f, 4);
+
+	uint16_t sign = (x>>16)&0x8000;
+	int32_t exponent = (int32_t)((x>>23)&0xff)-127+15;
+	uint32_t mantissa = x&0x7fffff;
+
+	if(((x>>23)&0xff) == 0xff) return sign|0x7c00|(mantissa ? 0x200 : 0);
+	if(exponent >= 31) return sign|0x7c00;
+
+	if(exponent <= 0){
+		if(exponent < -10) return sign;
+		mantissa |= 0x800000;
+		int32_t shift = 14-exponent;
+		uint32_t half = mantissa>>shift;
+		uint32_t rest = mantissa&((1u<<shift)-1), middle = 1u<<(shift-1);
+		if(rest > middle || (rest == middle && (half&1))) half++;
+		return sign|half;
+	}
+
+	uint32_t half = ((uint32_t)exponent<<10)|(mantissa>>13);
+	uint32_t rest = mantissa&0x1fff;
+	// a carry out of the mantissa moves on to the exponent, as it should.
+	if(rest > 0x1000 || (rest == 0x1000 && (half&1))) half++;
+	return sign|half;
+}
+
+inline float half_to_float(uint16_t h){
+
+	uint32_t sign = (uint32_t)(h&0x8000)<<16;
+	uint32_t exponent = (h>>10)&0x1f, mantissa = h&0x3ff;
+	uint32_t x;
+
+	if(exponent == 0){
+		if(mantissa == 0){
+			x = sign;
+		} else {
+			// subnormal, normalize it.
+			exponent = 127-15+1;
+			while(!(mantissa&0x400)){
+				mantissa <<= 1;
+				exponent--;
+			}
+			x = sign|(exponent<<23)|((mantissa&0x3ff)<<13);
+		}
+	} else if(exponent == 31){
+		x = sign|0x7f800000|(mantissa<<13);
+	} else {
+		x = sign|((exponent-15+127)<<23)|(mantissa<<13);
+	}
+
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+template<class T> class SpectrumCache{
+
+	/*
+	   The real FFTs (FFT::rfft) of a fixed set of samples,
+	   all at one transform size, worked out once so that a
+	   convolution layer reading the samples doesn't have to.
+
+	   In half precision each sample is scaled by its largest
+	   component first, so the 5 exponent bits only need to
+	   cover the range within a sample. That halves the memory
+	   for about 3 significant digits per value.
+	*/
+
+	protected:
+
+		int32_t count = 0, length = 0, size = 0, bins = 0;
+		bool half = 0;
+
+		vector<T> full;
+		vector<uint16_t> packed;
+		vector<float> scale;
+
+	public:
+
+		SpectrumCache(){}
+
+		/*
+		   fill(i, x) must write the length values of sample i
+		   into x. The spectra are made with fft at transform
+		   size size_ (from FFT::transform_size, even but not
+		   always a power of 2), the samples are split between
+		   threads.
+		*/
+		template<class F> void build(FFT<T> *fft, int32_t size_, int32_t count_, int32_t length_, F fill, bool half_ = 0){
+
+			this->count = count_;
+			this->length = length_;
+			this->size = size_;
+			this->bins = size_/2+1;
+			this->half = half_;
+
+			this->full.clear();
+			this->packed.clear();
+			this->scale.clear();
+
+			if(this->half){
+				this->packed.resize((size_t)2*this->bins*this->count);
+				this->scale.resize(this->count);
+			} else {
+				this->full.resize((size_t)2*this->bins*this->count);
+			}
+
+			fft->reserve(this->size);
+
+			parallel::parallel_for(0, this->count, 64, [&](int32_t a, int32_t b){
+
+				vector<T> x(this->length);
+				vector<complex<T> > spectrum(this->bins);
+
+				for(int32_t i=a; i<b; i++){
+
+					fill(i, x.data());
+					fft->rfft(x, this->size, spectrum.data());
+
+					if(this->half){
+						T top = 0;
+						for(auto &c : spectrum) top = std::max(top, std::max(std::fabs(c.real()), std::fabs(c.imag())));
+						float down = top > 0 ? (float)top : 1.0f;
+						uint16_t *out = this->packed.data()+(size_t)2*this->bins*i;
+						for(int32_t k=0; k<this->bins; k++){
+							out[2*k] = float_to_half((float)spectrum[k].real()/down);
+							out[2*k+1] = float_to_half((float)spectrum[k].imag()/down);
+						}
+						this->scale[i] = down;
+					} else {
+						T *out = this->full.data()+(size_t)2*this->bins*i;
+						for(int32_t k=0; k<this->bins; k++){
+							out[2*k] = spectrum[k].real();
+							out[2*k+1] = spectrum[k].imag();
+						}
+					}
+				}
+			});
+		}
+
+		void clear(){
+			*this = SpectrumCache<T>();
+		}
+
+		bool empty() const { return this->count == 0; }
+		int32_t samples() const { return this->count; }
+		int32_t sample_length() const { return this->length; }
+		int32_t transform_size() const { return this->size; }
+		bool is_half() const { return this->half; }
+
+		// the size/2+1 values of the spectrum of sample i into out.
+		void get(int32_t i, complex<T> *out) const {
+			if(this->half){
+				const uint16_t *in = this->packed.data()+(size_t)2*this->bins*i;
+				T up = (T)this->scale[i];
+				for(int32_t k=0; k<this->bins; k++){
+					out[k] = {(T)half_to_float(in[2*k])*up, (T)half_to_float(in[2*k+1])*up};
+				}
+			} else {
+				const T *in = this->full.data()+(size_t)2*this->bins*i;
+				for(int32_t k=0; k<this->bins; k++) out[k] = {in[2*k], in[2*k+1]};
+			}
+		}
+};
+
+#endif
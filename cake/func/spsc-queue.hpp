@@ -0,0 +1,77 @@
+#ifndef SPSC_QUEUE_HPP_
+#define SPSC_QUEUE_HPP_
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+using std::vector;
+
+template<class Item> class SpscQueue{
+
+	/*
+	   A lock-free queue between exactly one producer thread
+	   and one consumer thread, a ring of a fixed number of slots.
+
+	   Items are swapped in and out instead of copied: push
+	   leaves the producer with whatever the slot held before,
+	   pop leaves the slot with whatever the consumer held. Filling
+	   the slots with buffers of the right size up front means
+	   buffers just circulate between the two threads and nothing
+	   is allocated while the queue is in use.
+
+	   head & tail count pops & pushes, only the consumer
+	   writes head and only the producer writes tail.
+	*/
+
+	protected:
+
+		vector<Item> slot;
+		uint32_t mask = 0;
+
+		alignas(64) std::atomic<uint32_t> head;
+		alignas(64) std::atomic<uint32_t> tail;
+
+	public:
+
+		// capacity is rounded up to a power of 2.
+		SpscQueue(int32_t capacity, const Item &fill = Item()){
+			uint32_t size = 1;
+			while((int32_t)size < capacity) size *= 2;
+			this->slot.assign(size, fill);
+			this->mask = size-1;
+			this->head.store(0);
+			this->tail.store(0);
+		}
+
+		SpscQueue(const SpscQueue&) = delete;
+		SpscQueue &operator=(const SpscQueue&) = delete;
+
+		bool try_push(Item &item){
+			uint32_t t = this->tail.load(std::memory_order_relaxed);
+			if(t-this->head.load(std::memory_order_acquire) == (uint32_t)this->slot.size()) return 0;
+			std::swap(this->slot[t&this->mask], item);
+			this->tail.store(t+1, std::memory_order_release);
+			return 1;
+		}
+
+		bool try_pop(Item &item){
+			uint32_t h = this->head.load(std::memory_order_relaxed);
+			if(this->tail.load(std::memory_order_acquire) == h) return 0;
+			std::swap(item, this->slot[h&this->mask]);
+			this->head.store(h+1, std::memory_order_release);
+			return 1;
+		}
+
+		// these wait until there is room / an item.
+		void push(Item &item){
+			while(!this->try_push(item)) std::this_thread::yield();
+		}
+
+		void pop(Item &item){
+			while(!this->try_pop(item)) std::this_thread::yield();
+		}
+};
+
+#endif
@@ -0,0 +1,422 @@
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+
+using std::vector;
+
+/*
+   A work-stealing thread pool.
+
+   Every worker thread owns a deque of tasks. A worker pushes
+   the tasks it forks to the bottom of its own deque and takes
+   them back from the bottom (newest first, so the data is
+   still in its cache), idle workers steal from the top of
+   the others' deques (oldest first, usually the biggest
+   pieces of work). Pushing and taking touch only the owner's
+   end, so the fast path has no locks, just a few atomics.
+
+   Threads that aren't workers of the pool (the main thread,
+   pipeline stages, ...) hand their tasks in through a shared
+   queue under a mutex, that only happens at the top of a
+   parallel job.
+
+   A thread that waits for its tasks doesn't block, it runs
+   other tasks in the meantime (its own first, then stolen
+   ones). So tasks can fork and wait for tasks of their own
+   to any depth, and the pool never runs more threads than
+   it was made with, whoever schedules onto it.
+
+   Tasks are not allocated by the pool, they live wherever the
+   one who forks them puts them (usually its stack) and must
+   stay there until they're waited for.
+*/
+
+class TaskGroup;
+
+class Task{
+
+	/*
+	   Something to run, execute() is called once by
+	   whatever thread gets to it first.
+	*/
+
+	public:
+
+		TaskGroup *group = NULL;
+
+		virtual ~Task(){}
+		virtual void execute() = 0;
+};
+
+template<class F> class FunctionTask : public Task{
+
+	public:
+
+		F f;
+
+		FunctionTask(const F &f_) : f(f_){}
+
+		void execute(){ f(); }
+};
+
+class WorkDeque{
+
+	/*
+	   The Chase-Lev deque: bottom is only written by the owner,
+	   top is moved by CAS both by thieves and (for the last task)
+	   by the owner, so each task is taken exactly once.
+
+	   The ring grows when it's full. The old rings are kept until
+	   the deque is destroyed, a thief may still be reading one.
+	*/
+
+	protected:
+
+		struct Ring{
+			int64_t mask;
+			vector<std::atomic<Task*> > slot;
+			Ring(int64_t size) : mask(size-1), slot(size){}
+			Task *get(int64_t i){ return slot[i&mask].load(std::memory_order_relaxed); }
+			void put(int64_t i, Task *t){ slot[i&mask].store(t, std::memory_order_relaxed); }
+		};
+
+		alignas(64) std::atomic<int64_t> top;
+		alignas(64) std::atomic<int64_t> bottom;
+		std::atomic<Ring*> ring;
+		vector<Ring*> rings;
+
+		Ring *grow(Ring *old, int64_t t, int64_t b){
+			Ring *bigger = new Ring(2*(old->mask+1));
+			for(int64_t i=t; i<b; i++) bigger->put(i, old->get(i));
+			this->rings.push_back(bigger);
+			this->ring.store(bigger, std::memory_order_release);
+			return bigger;
+		}
+
+	public:
+
+		WorkDeque(int64_t capacity = 256){
+			this->top.store(0);
+			this->bottom.store(0);
+			this->rings.push_back(new Ring(capacity));
+			this->ring.store(this->rings.back());
+		}
+
+		~WorkDeque(){
+			for(auto i : this->rings) delete i;
+		}
+
+		WorkDeque(const WorkDeque&) = delete;
+		WorkDeque &operator=(const WorkDeque&) = delete;
+
+		// owner only.
+		void push(Task *task){
+			int64_t b = this->bottom.load(std::memory_order_relaxed);
+			int64_t t = this->top.load(std::memory_order_acquire);
+			Ring *r = this->ring.load(std::memory_order_relaxed);
+			if(b-t > r->mask) r = this->grow(r, t, b);
+			r->put(b, task);
+			this->bottom.store(b+1, std::memory_order_seq_cst);
+		}
+
+		// owner only, the newest task or NULL.
+		Task *take(){
+			int64_t b = this->bottom.load(std::memory_order_relaxed)-1;
+			Ring *r = this->ring.load(std::memory_order_relaxed);
+			this->bottom.store(b, std::memory_order_seq_cst);
+			int64_t t = this->top.load(std::memory_order_seq_cst);
+
+			if(t > b){
+				this->bottom.store(b+1, std::memory_order_relaxed);
+				return NULL;
+			}
+
+			Task *task = r->get(b);
+			if(t == b){
+				// the last one, race the thieves for it.
+				if(!this->top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst)) task = NULL;
+				this->bottom.store(b+1, std::memory_order_relaxed);
+			}
+			return task;
+		}
+
+		// any thread, the oldest task or NULL (also when another thief won).
+		Task *steal(){
+			int64_t t = this->top.load(std::memory_order_seq_cst);
+			int64_t b = this->bottom.load(std::memory_order_seq_cst);
+			if(t >= b) return NULL;
+
+			Ring *r = this->ring.load(std::memory_order_acquire);
+			Task *task = r->get(t);
+			if(!this->top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst)) return NULL;
+			return task;
+		}
+
+		bool empty() const {
+			return this->top.load(std::memory_order_seq_cst) >= this->bottom.load(std::memory_order_seq_cst);
+		}
+};
+
+class ThreadPool{
+
+	protected:
+
+		struct Worker{
+			WorkDeque deque;
+			std::thread thread;
+			uint32_t seed;
+		};
+
+		vector<Worker*> workers;
+
+		// tasks from threads outside the pool.
+		std::mutex shared_mutex;
+		std::deque<Task*> shared;
+		std::atomic<int32_t> shared_size;
+
+		// the idle workers sleep on wake, see idle().
+		std::mutex sleep_mutex;
+		std::condition_variable wake;
+		std::atomic<int32_t> sleepers;
+		uint64_t wakeups = 0;
+		bool stopping = 0;
+
+		// the pool & worker the calling thread belongs to.
+		static ThreadPool *&current_pool(){
+			static thread_local ThreadPool *pool = NULL;
+			return pool;
+		}
+
+		static Worker *&current_worker(){
+			static thread_local Worker *worker = NULL;
+			return worker;
+		}
+
+		Worker *self(){
+			return current_pool() == this ? current_worker() : NULL;
+		}
+
+		Task *take_shared(){
+			if(this->shared_size.load(std::memory_order_seq_cst) == 0) return NULL;
+			std::lock_guard<std::mutex> lock(this->shared_mutex);
+			if(this->shared.empty()) return NULL;
+			Task *task = this->shared.front();
+			this->shared.pop_front();
+			this->shared_size.fetch_sub(1, std::memory_order_seq_cst);
+			return task;
+		}
+
+		// some task to run: our own newest, the shared queue's oldest or a stolen one.
+		Task *find(Worker *me){
+
+			Task *task = NULL;
+			if(me) task = me->deque.take();
+			if(!task) task = this->take_shared();
+			if(task || this->workers.empty()) return task;
+
+			// look at every other deque once, from a random one on.
+			uint32_t seed = me ? me->seed : (uint32_t)(size_t)&task;
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			if(me) me->seed = seed;
+
+			int32_t count = this->workers.size();
+			for(int32_t k=0; k<count && !task; k++){
+				Worker *victim = this->workers[(seed+k)%count];
+				if(victim != me) task = victim->deque.steal();
+			}
+			return task;
+		}
+
+		bool has_work(){
+			if(this->shared_size.load(std::memory_order_seq_cst)) return 1;
+			for(auto i : this->workers) if(!i->deque.empty()) return 1;
+			return 0;
+		}
+
+		void run_task(Task *task){
+			TaskGroup *group = task->group;
+			task->execute();
+			// the task may be gone as soon as the group sees it done.
+			this->finished(group);
+		}
+
+		inline void finished(TaskGroup *group);
+
+		void notify(){
+			if(this->sleepers.load(std::memory_order_seq_cst) == 0) return;
+			{
+				std::lock_guard<std::mutex> lock(this->sleep_mutex);
+				this->wakeups++;
+			}
+			this->wake.notify_one();
+		}
+
+		/*
+		   Nothing to do: spin a little, then sleep until someone
+		   pushes a task. The sleeper count goes up before the last
+		   look for work and a pusher checks it after pushing, so one
+		   of the two always sees the other.
+		*/
+		void idle(){
+
+			for(int32_t i=0; i<64; i++){
+				if(this->has_work()) return;
+				std::this_thread::yield();
+			}
+
+			std::unique_lock<std::mutex> lock(this->sleep_mutex);
+			this->sleepers.fetch_add(1, std::memory_order_seq_cst);
+			if(!this->stopping && !this->has_work()){
+				uint64_t seen = this->wakeups;
+				this->wake.wait(lock, [&]{ return this->stopping || this->wakeups != seen; });
+			}
+			this->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+		}
+
+		void work(Worker *me){
+
+			current_pool() = this;
+			current_worker() = me;
+
+			while(1){
+				Task *task = this->find(me);
+				if(task){
+					this->run_task(task);
+					continue;
+				}
+				{
+					std::lock_guard<std::mutex> lock(this->sleep_mutex);
+					if(this->stopping) break;
+				}
+				this->idle();
+			}
+
+			current_pool() = NULL;
+			current_worker() = NULL;
+		}
+
+	public:
+
+		// threads counts the calling thread, which helps whenever it waits.
+		ThreadPool(int32_t threads){
+			this->shared_size.store(0);
+			this->sleepers.store(0);
+			for(int32_t k=1; k<threads; k++){
+				Worker *w = new Worker();
+				w->seed = 2463534242u+k*7919u;
+				this->workers.push_back(w);
+			}
+			for(auto i : this->workers) i->thread = std::thread(&ThreadPool::work, this, i);
+		}
+
+		/*
+		   Lets the workers finish what's queued and joins them.
+		   Nothing may be waiting on the pool any more.
+		*/
+		~ThreadPool(){
+			{
+				std::lock_guard<std::mutex> lock(this->sleep_mutex);
+				this->stopping = 1;
+			}
+			this->wake.notify_all();
+			for(auto i : this->workers) i->thread.join();
+			for(auto i : this->workers) delete i;
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool &operator=(const ThreadPool&) = delete;
+
+		int32_t size() const { return this->workers.size()+1; }
+
+		void push(Task *task){
+			Worker *me = this->self();
+			if(me){
+				me->deque.push(task);
+			} else {
+				std::lock_guard<std::mutex> lock(this->shared_mutex);
+				this->shared.push_back(task);
+				this->shared_size.fetch_add(1, std::memory_order_seq_cst);
+			}
+			this->notify();
+		}
+
+		// runs other tasks until done() is true.
+		template<class F> void help_until(F done){
+			Worker *me = this->self();
+			int32_t misses = 0;
+			while(!done()){
+				Task *task = this->find(me);
+				if(task){
+					this->run_task(task);
+					misses = 0;
+				} else if(++misses > 16){
+					std::this_thread::yield();
+				}
+			}
+		}
+};
+
+class TaskGroup{
+
+	/*
+	   Fork/join: run() hands tasks to the pool, wait() returns
+	   once all of them are done, running tasks meanwhile.
+	   A group is used by the one thread that made it,
+	   and must be waited for before it goes away.
+	*/
+
+	protected:
+
+		ThreadPool *pool;
+		vector<Task*> owned;
+
+	public:
+
+		std::atomic<int32_t> pending;
+
+		TaskGroup(ThreadPool *pool_) : pool(pool_){
+			this->pending.store(0);
+		}
+
+		~TaskGroup(){
+			this->wait();
+			for(auto i : this->owned) delete i;
+		}
+
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup &operator=(const TaskGroup&) = delete;
+
+		// task must stay alive until wait() returns.
+		void spawn(Task *task){
+			task->group = this;
+			this->pending.fetch_add(1, std::memory_order_relaxed);
+			this->pool->push(task);
+		}
+
+		// the group keeps a copy of f.
+		template<class F> void run(const F &f){
+			Task *task = new FunctionTask<F>(f);
+			this->owned.push_back(task);
+			this->spawn(task);
+		}
+
+		void wait(){
+			this->pool->help_until([&]{ return this->pending.load(std::memory_order_acquire) == 0; });
+		}
+};
+
+inline void ThreadPool::finished(TaskGroup *group){
+	group->pending.fetch_sub(1, std::memory_order_release);
+}
+
+#endif
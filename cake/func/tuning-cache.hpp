@@ -0,0 +1,167 @@
+#ifndef TUNING_CACHE_HPP_
+#define TUNING_CACHE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include "kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+
+class TuningCache{
+
+	/*
+	   The fastest implementation of each layer shape, as
+	   measured by ReversibleCake::autotune, kept in a file so
+	   that later runs on the same kind of machine don't have
+	   to measure again.
+
+	   Each line of the file is one result:
+
+	   implementation <tab> batch <tab> shape <tab> cpu
+
+	   where shape is ReversibleLayer::shape_key and cpu is
+	   the model name of the processor plus the SIMD set the
+	   kernels run on. Lines of other machines are kept as
+	   they are, so one file can be shared by different hosts.
+	*/
+
+	protected:
+
+		string filename;
+		string cpu;
+		int32_t batch = 32;
+
+		std::map<string, int32_t> best;
+		bool changed = 0;
+
+		string key(const string &shape) const {
+			return std::to_string(this->batch)+'\t'+shape+'\t'+this->cpu;
+		}
+
+	public:
+
+		// the measuring time per implementation, in seconds.
+		double min_time = 0.02;
+
+		TuningCache(){
+			this->cpu = cpu_model();
+		}
+
+		// batch_ is the batch size the layers are measured at.
+		TuningCache(string filename_, int32_t batch_ = 32){
+			this->cpu = cpu_model();
+			this->batch = std::max(1, batch_);
+			this->load(filename_);
+		}
+
+		~TuningCache(){}
+
+		int32_t batch_size() const { return this->batch; }
+
+		const string &cpu_key() const { return this->cpu; }
+
+		// the processor model, from /proc/cpuinfo or else cpuid.
+		static string cpu_model(){
+
+			string name;
+
+			ifstream info("/proc/cpuinfo");
+			string line;
+			while(name.empty() && std::getline(info, line)){
+				if(line.compare(0, 10, "model name") != 0) continue;
+				size_t colon = line.find(':');
+				if(colon != string::npos) name = line.substr(colon+1);
+			}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+			if(name.empty()){
+				uint32_t r[12];
+				if(__get_cpuid(0x80000000, &r[0], &r[1], &r[2], &r[3]) && r[0] >= 0x80000004){
+					for(uint32_t k=0; k<3; k++) __get_cpuid(0x80000002+k, &r[4*k], &r[4*k+1], &r[4*k+2], &r[4*k+3]);
+					name.assign((const char*)r, 48);
+					name = name.c_str();
+				}
+			}
+#endif
+
+			// no tabs, one space between words.
+			std::istringstream words(name);
+			string word, clean;
+			while(words >> word) clean += (clean.empty() ? "" : " ")+word;
+			if(clean.empty()) clean = "unknown";
+
+			return clean+" / "+kernels::isa_name();
+		}
+
+		void load(string filename_){
+
+			this->filename = filename_;
+			this->best.clear();
+			this->changed = 0;
+
+			ifstream get_in(this->filename);
+			string line;
+			while(std::getline(get_in, line)){
+				size_t tab = line.find('\t');
+				if(tab == string::npos || tab == 0) continue;
+				this->best[line.substr(tab+1)] = std::atoi(line.substr(0, tab).c_str());
+			}
+		}
+
+		// writes the file, if something was added since it was read.
+		void save(){
+
+			if(!this->changed || this->filename.empty()) return;
+
+			ofstream get_out(this->filename);
+			for(auto &i : this->best) get_out << i.second << '\t' << i.first << '\n';
+			get_out.close();
+
+			this->changed = 0;
+		}
+
+		// the stored implementation for shape on this machine, -1 if there's none.
+		int32_t find(const string &shape) const {
+			auto i = this->best.find(this->key(shape));
+			return i == this->best.end() ? -1 : i->second;
+		}
+
+		void store(const string &shape, int32_t implementation){
+			this->best[this->key(shape)] = implementation;
+			this->changed = 1;
+		}
+
+		// seconds per run(), run at least 3 times and for min_time in total after a warm up.
+		template<class F> double time(F run) const {
+
+			typedef std::chrono::steady_clock clock;
+
+			run();
+
+			int32_t count = 0;
+			clock::time_point start = clock::now();
+			double spent = 0;
+			while(count < 3 || spent < this->min_time){
+				run();
+				count++;
+				spent = std::chrono::duration<double>(clock::now()-start).count();
+			}
+			return spent/count;
+		}
+};
+
+#endif
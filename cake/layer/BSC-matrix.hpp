@@ -7,6 +7,7 @@
 
 #include "base.hpp"
 #include "base-reversible.hpp"
+#include "../func/dense-matrix.hpp"
 
 using std::vector;
 using std::ifstream;
@@ -19,8 +20,28 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 	protected:
 
 		T one;
-		vector<vector<T> > mx, mxC;
+		DenseMatrix<T> mx, mxC;
 		vector<T> bias, sens, biasC, sensC, slope, ucv;
+		DenseMatrix<T> bslope, bucv;
+
+		// the compression slope of row b of the batch
+		virtual const T *batch_slope(int32_t b){
+			return this->slope.data();
+		}
+
+		// bias & sensetivity for every row of the batch
+		void shift_batch(){
+
+			this->bucv.resize(this->bv.get_rows(), this->n, this->zero);
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				T *x = this->bv.line(b), *u = this->bucv.line(b);
+				for(int32_t i=0; i<this->n; i++){
+					x[i] = (x[i]+this->bias[i])*this->sens[i];
+					u[i] = x[i];
+				}
+			}
+		}
 
 	public:
 
@@ -37,7 +58,7 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 		   
 		   Last, the data is shuffled with a matrix on to the next layer.
 		   Each node i from this layer effects each node j in the
-		   next layer with some coefficient mx[i][j].
+		   next layer with some coefficient mx(i, j).
 
 		*/
 
@@ -96,9 +117,13 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 
 		void connect_next(int32_t m_){
 			this->m = m_;
-			vector<T> tmp(m_, this->zero);
-			this->mx.resize(this->n, tmp);
-			this->mxC.resize(this->n, tmp);
+			this->mx.resize(this->n, m_, this->zero);
+			this->mxC.resize(this->n, m_, this->zero);
+		}
+
+		void set_matrix_layout(MatrixLayout layout){
+			this->mx.set_layout(layout);
+			this->mxC.set_layout(layout);
 		}
 		
 		void project_next(Layer<T> *next){
@@ -106,14 +131,19 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			next->set_vector_all(this->zero);
 			
 			for(int32_t i=0; i<this->n; i++){
-				
 				this->v[i] = (this->v[i]+this->bias[i])*this->sens[i];
 				this->ucv[i] = this->v[i];
-
-				for(int32_t j=0; j<this->m; j++){
-					next->v[j] += this->mx[i][j]*this->v[i];
-				}
 			}
+
+			this->mx.project(this->v.data(), next->v.data());
+		}
+
+		void project_next_batch(Layer<T> *next){
+			
+			next->bv.fill(this->zero);
+			
+			this->shift_batch();
+			this->mx.project_batch(this->bv, next->bv);
 		}
 
 		void variables_in(ifstream &get_in){
@@ -139,7 +169,7 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			for(int32_t i=0; i<this->n; i++) get_in >> this->bias[i];
 			for(int32_t i=0; i<this->n; i++) get_in >> this->sens[i];	
 			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++) get_in >> this->mx[i][j];
+				for(int32_t j=0; j<this->m; j++) get_in >> this->mx(i, j);
 			}
 
 		}
@@ -158,18 +188,48 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					get_out << this->mx[i][j] << ' ';
+					get_out << this->mx(i, j) << ' ';
 				} get_out << '\n';
 			}
 		}
 
+		BSCMatrixLayer<T> *clone(){
+			return new BSCMatrixLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			BSCMatrixLayer<T> *o = static_cast<BSCMatrixLayer<T>*>(other);
+			this->mx = o->mx;
+			this->bias = o->bias;
+			this->sens = o->sens;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			BSCMatrixLayer<T> *o = static_cast<BSCMatrixLayer<T>*>(other);
+			this->mxC.add_scaled(o->mxC, (T)1);
+			for(int32_t i=0; i<this->n; i++){
+				this->biasC[i] += o->biasC[i];
+				this->sensC[i] += o->sensC[i];
+			}
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			BSCMatrixLayer<T> *t = static_cast<BSCMatrixLayer<T>*>(target);
+			for(int32_t i=0; i<this->n; i++){
+				t->bias[i] += this->config[1]*this->biasC[i];
+				t->sens[i] += this->config[2]*this->sensC[i];
+			}
+			t->mx.add_scaled(this->mxC, this->config[0]);
+		}
+
 		void set_variables(T val){
 			
 			for(int32_t i=0; i<this->n; i++){
 				this->bias[i] = val;
 				this->sens[i] = val;
 				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] = val;
+					this->mx(i, j) = val;
 				}
 			}
 		}
@@ -178,7 +238,7 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] = random_func();
+					this->mx(i, j) = random_func();
 				}
 			}
 		}
@@ -187,10 +247,8 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			for(int32_t i=0; i<this->n; i++){
 				this->biasC[i] /= down;
 				this->sensC[i] /= down;
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] /= down;
-				}
 			}
+			this->mxC.divide(down);
 		}
 		
 		void zero_changes(){
@@ -200,23 +258,17 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 				this->vC[i] = this->zero;
 				this->biasC[i] = this->zero;
 				this->sensC[i] = this->zero;
-
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] = this->zero;
-				}
 			}
+
+			this->mxC.fill(this->zero);
 		}
 
-		void evaluate(vector<T> feedback){
+		void evaluate(Span<const T> feedback){
 
 			this->set_vector_changes(this->zero);
 
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] += this->v[i]*feedback[j];
-					this->vC[i] += this->mx[i][j]*feedback[j];
-				}
-			}
+			this->mxC.add_outer(this->v.data(), feedback.data());
+			this->mx.project_back(feedback.data(), this->vC.data());
 
 			for(int32_t i=0; i<this->n; i++){
 				this->vC[i] *= this->slope[i];
@@ -226,15 +278,34 @@ template<class T> class BSCMatrixLayer: public ReversibleLayer<T>{
 			}
 		}
 
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			this->bvC.fill(this->zero);
+
+			this->mxC.add_outer_batch(this->bv, feedback);
+			this->mx.project_back_batch(feedback, this->bvC);
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				
+				T *x = this->bvC.line(b);
+				const T *s = this->batch_slope(b), *u = this->bucv.line(b);
+
+				for(int32_t i=0; i<this->n; i++){
+					x[i] *= s[i];
+					this->biasC[i] += x[i];
+					this->sensC[i] += x[i]*u[i];
+					x[i] *= this->sens[i];
+				}
+			}
+		}
+
 		void adjust(){
 			
 			for(int32_t i=0; i<this->n; i++){
 				this->bias[i] += this->config[1]*this->biasC[i];
 				this->sens[i] += this->config[2]*this->sensC[i];
-				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] += this->config[0]*this->mxC[i][j];
-				}
 			}
+			this->mx.add_scaled(this->mxC, this->config[0]);
 		}	
 };
 
@@ -17,6 +17,12 @@ const int32_t BSC1DX_MATRIX_LAYER_ID = 0x0041;
 
 template<class T> class BSC1dxMatrixLayer: public BSCMatrixLayer<T>{
 	
+	protected:
+
+		const T *batch_slope(int32_t b){
+			return this->bslope.line(b);
+		}
+
 	public:
 
 		/*
@@ -32,7 +38,7 @@ template<class T> class BSC1dxMatrixLayer: public BSCMatrixLayer<T>{
 		   
 		   Last, the data is shuffled with a matrix on to the next layer.
 		   Each node i from this layer effects each node j in the
-		   next layer with some coefficient mx[i][j].
+		   next layer with some coefficient mx(i, j).
 
 		*/
 
@@ -57,6 +63,10 @@ template<class T> class BSC1dxMatrixLayer: public BSCMatrixLayer<T>{
 
 		~BSC1dxMatrixLayer(){}
 
+		BSC1dxMatrixLayer<T> *clone(){
+			return new BSC1dxMatrixLayer<T>(*this);
+		}
+
 		void init_config(){	
 			this->configClar = {
 				"matrix_change_speed:",
@@ -74,14 +84,26 @@ template<class T> class BSC1dxMatrixLayer: public BSCMatrixLayer<T>{
 			compress::div_x<T>(this->v, this->slope, {this->config[3]});
 
 			for(int32_t i=0; i<this->n; i++){
-				
 				this->v[i] = (this->v[i]+this->bias[i])*this->sens[i];
 				this->ucv[i] = this->v[i];
+			}
 
-				for(int32_t j=0; j<this->m; j++){
-					next->v[j] += this->mx[i][j]*this->v[i];
-				}
+			this->mx.project(this->v.data(), next->v.data());
+		}
+
+		void project_next_batch(Layer<T> *next){
+
+			next->bv.fill(this->zero);
+
+			this->bslope.resize(this->bv.get_rows(), this->n, this->zero);
+			
+			vector<T> c = {this->config[3]};
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				compress::div_x<T>(this->bv.line(b), this->bslope.line(b), this->n, c);
 			}
+
+			this->shift_batch();
+			this->mx.project_batch(this->bv, next->bv);
 		}
 };
 
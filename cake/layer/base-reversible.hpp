@@ -2,10 +2,14 @@
 #define BASE_REVERSIBLE_LAYER_HPP_
 
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <fstream>
 
+#include "../func/spectrum-cache.hpp"
+
 using std::vector;
+using std::string;
 using std::ifstream;
 using std::ofstream;
 
@@ -25,6 +29,7 @@ template<class T> class ReversibleLayer : public Layer<T>{
 	protected:
 
 		vector<T> vC;
+		DenseMatrix<T> bvC;
 
 	public:
 
@@ -66,6 +71,26 @@ template<class T> class ReversibleLayer : public Layer<T>{
 			this->config_out(get_out, 0);
 		}
 
+		/*
+		   For running copies of a cake on many threads at once.
+		   clone makes a copy of the layer with its own data & changes.
+		   copy_variables takes the variables (& config) of another
+		   layer of the same class, add_changes adds its accumulated
+		   changes to the ones of this layer. push_changes is adjust,
+		   but the changes go to the variables of target instead.
+		*/
+		virtual ReversibleLayer<T> *clone(){
+			return new ReversibleLayer<T>(*this);
+		}
+
+		virtual void copy_variables(ReversibleLayer<T> *other){
+			this->config = other->config;
+		}
+
+		virtual void add_changes(ReversibleLayer<T> *other){}
+
+		virtual void push_changes(ReversibleLayer<T> *target){}
+
 		// set all variables to a specific value
 		virtual void set_variables(){}
 
@@ -76,10 +101,19 @@ template<class T> class ReversibleLayer : public Layer<T>{
 			for(T &i : this->vC) i = val;
 		}
 
-		vector<T> get_vector_changes(){
+		Span<const T> get_vector_changes() const {
 			return this->vC;
 		}
 
+		void set_batch_size(int32_t batch){
+			Layer<T>::set_batch_size(batch);
+			this->bvC.resize(batch, this->n, this->zero);
+		}
+
+		const DenseMatrix<T> &get_batch_changes(){
+			return this->bvC;
+		}
+
 		virtual void downscale_changes(T down){}
 		
 		// for resetting the changes between training batches
@@ -88,15 +122,63 @@ template<class T> class ReversibleLayer : public Layer<T>{
 		}
 
 		// accumulate desired changes from feedback.
-		virtual void evaluate(vector<T> feedback){
+		virtual void evaluate(Span<const T> feedback){
 			for(int32_t i=0; i<std::min(this->n, this->m); i++){
 				this->vC[i] = feedback[i];
 			}
 		}
 
+		/*
+		   The batch version of evaluate, for a batch that just went
+		   through project_next_batch. Row b of feedback is the feedback
+		   for row b of the batch, the changes for each row go to
+		   the matching row of bvC. This runs the rows one by one
+		   through evaluate, layers override it when they can do better.
+		*/
+		virtual void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				std::copy(this->bv.line(b), this->bv.line(b)+this->n, this->v.begin());
+				this->evaluate(Span<const T>(feedback.line(b), this->m));
+				std::copy(this->vC.begin(), this->vC.end(), this->bvC.line(b));
+			}
+		}
+
 		// desired changes are implemented.
 		virtual void adjust(){}
 
+		/*
+		   For layers that take their input through FFTs: the
+		   size of the transforms, or 0 if the layer doesn't.
+		   A SpectrumCache of the inputs made at that size can be
+		   handed to use_input_spectra, then row b of the following
+		   batches is taken to be sample samples[b] of the cache
+		   and its spectrum isn't worked out again. A NULL cache
+		   (or one that doesn't fit) turns this off.
+		*/
+		virtual int32_t input_transform_size(){ return 0; }
+
+		virtual void use_input_spectra(const SpectrumCache<T> *cache, Span<const int32_t> samples){}
+
+		/*
+		   Layers that can do the same maths in more than one way
+		   (directly or through FFTs, ...) have implementations() > 1,
+		   use_implementation(k) switches to way k. Which one is
+		   the fastest depends on the shape of the layer and the
+		   machine, see ReversibleCake::autotune. shape_key has
+		   all the speed depends on besides the batch size,
+		   with spaces between the numbers.
+		*/
+		virtual int32_t implementations(){ return 1; }
+
+		virtual int32_t implementation(){ return 0; }
+
+		virtual void use_implementation(int32_t k){}
+
+		virtual string shape_key(){
+			return std::to_string(this->id)+' '+std::to_string(this->n)+' '+std::to_string(this->m);
+		}
+
 };
 
 #endif
@@ -5,6 +5,9 @@
 #include <algorithm>
 #include <fstream>
 
+#include "../func/dense-matrix.hpp"
+#include "../func/span.hpp"
+
 using std::vector;
 using std::string;
 using std::ifstream;
@@ -23,6 +26,8 @@ template<class T> class Layer{
 	   m is the size of the next layer.
 	   id is an (id)entifying integer (preferably unique for every layer class).
 	   "zero" is the default value in the array.
+	   bv holds a batch of data vectors, one per row, for
+	   running many inputs through the layer at once.
 
 	   Most of the functions in this class are
 	   meant to be overridden by it's child classes,
@@ -58,6 +63,7 @@ template<class T> class Layer{
 		
 		int32_t n=0, id=BASE_LAYER_ID;
 		vector<T> v;
+		DenseMatrix<T> bv;
 
 		Layer(){ this->id = BASE_LAYER_ID; }
 		
@@ -91,14 +97,23 @@ template<class T> class Layer{
 			for(T &i : v) i = val;
 		}
 
-		void set_vector_values(vector<T> v_){
-			this->v = v_;
+		void set_vector_values(Span<const T> v_){
+			this->v.assign(v_.begin(), v_.end());
 		}
 
-		vector<T> get_vector(){
+		// a view of v, valid until the layer changes size.
+		Span<const T> get_vector() const {
 			return this->v;
 		}
 
+		virtual void set_batch_size(int32_t batch){
+			this->bv.resize(batch, this->n, this->zero);
+		}
+
+		void set_batch_values(const DenseMatrix<T> &bv_){
+			this->bv = bv_;
+		}
+
 		virtual void connect_next(int32_t m_){
 			this->m = m_;
 		}
@@ -110,6 +125,20 @@ template<class T> class Layer{
 			}
 		}
 		
+		/*
+		   The batch version of project_next: row b of next->bv
+		   is what project_next would give for row b of bv.
+		   This runs the rows one by one through project_next,
+		   layers override it when they can do better.
+		*/
+		virtual void project_next_batch(Layer<T> *next){
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				std::copy(this->bv.line(b), this->bv.line(b)+this->n, this->v.begin());
+				this->project_next(next);
+				std::copy(next->v.begin(), next->v.end(), next->bv.line(b));
+			}
+		}
+		
 		/*
 		   These functions are for changing things about the class
 		   when it's being trained. Like how fast variables change & such.
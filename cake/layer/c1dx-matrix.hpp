@@ -21,6 +21,7 @@ template<class T> class C1dxMatrixLayer: public MatrixLayer<T>{
 	protected:
 
 		vector<T> slope;
+		DenseMatrix<T> bslope;
 
 	public:
 
@@ -61,6 +62,10 @@ template<class T> class C1dxMatrixLayer: public MatrixLayer<T>{
 		
 		~C1dxMatrixLayer(){}
 
+		C1dxMatrixLayer<T> *clone(){
+			return new C1dxMatrixLayer<T>(*this);
+		}
+
 		void init_config(){
 			this->configClar = {"matrix_change_speed:", "x-axis_compression:"};
 			this->config = {(T)0.01, (T)1};
@@ -72,12 +77,22 @@ template<class T> class C1dxMatrixLayer: public MatrixLayer<T>{
 			
 			next->set_vector_all(this->zero);
 
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					next->v[j] += this->mx[i][j]*this->v[i];
-				}
+			this->mx.project(this->v.data(), next->v.data());
+
+		}
+
+		void project_next_batch(Layer<T> *next){
+
+			this->bslope.resize(this->bv.get_rows(), this->n, this->zero);
+			
+			vector<T> c = {this->config[1]};
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				compress::div_x<T>(this->bv.line(b), this->bslope.line(b), this->n, c);
 			}
 
+			next->bv.fill(this->zero);
+
+			this->mx.project_batch(this->bv, next->bv);
 		}
 		
 		void variables_in(ifstream &get_in){
@@ -94,7 +109,7 @@ template<class T> class C1dxMatrixLayer: public MatrixLayer<T>{
 			this->slope.resize(this->n, this->zero);
 			
 			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++) get_in >> this->mx[i][j];
+				for(int32_t j=0; j<this->m; j++) get_in >> this->mx(i, j);
 			}
 
 		}
@@ -108,32 +123,35 @@ template<class T> class C1dxMatrixLayer: public MatrixLayer<T>{
 			
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					get_out << this->mx[i][j] << ' ';
+					get_out << this->mx(i, j) << ' ';
 				} get_out << '\n';
 			}
 		}
 		
-		void evaluate(vector<T> feedback){
+		void evaluate(Span<const T> feedback){
 
 			this->set_vector_changes(this->zero);
 
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] += this->v[i]*feedback[j];
-					this->vC[i] += this->mx[i][j]*feedback[j];
-				}
-			}
+			this->mxC.add_outer(this->v.data(), feedback.data());
+			this->mx.project_back(feedback.data(), this->vC.data());
 
 			for(int32_t i=0; i<this->n; i++) this->vC[i] *= this->slope[i];
 
 		}
 
-		void adjust(){
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] += this->config[0]*this->mxC[i][j];
-				}
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			MatrixLayer<T>::evaluate_batch(feedback);
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				T *x = this->bvC.line(b);
+				const T *s = this->bslope.line(b);
+				for(int32_t i=0; i<this->n; i++) x[i] *= s[i];
 			}
+		}
+
+		void adjust(){
+			this->mx.add_scaled(this->mxC, this->config[0]);
 		}	
 
 };
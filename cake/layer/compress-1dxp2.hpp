@@ -20,6 +20,7 @@ template<class T> class C1dxp2Layer: public ReversibleLayer<T>{
 	protected:
 
 		vector<T> slope;
+		DenseMatrix<T> bslope;
 
 	public:
 
@@ -58,6 +59,10 @@ template<class T> class C1dxp2Layer: public ReversibleLayer<T>{
 		
 		~C1dxp2Layer(){}
 
+		C1dxp2Layer<T> *clone(){
+			return new C1dxp2Layer<T>(*this);
+		}
+
 		void init_config(){
 			this->configClar = {"x-axis_compression:"};
 			this->config = {(T)1};
@@ -71,6 +76,20 @@ template<class T> class C1dxp2Layer: public ReversibleLayer<T>{
 				next->v[i] = this->v[i];
 			}
 		}
+
+		void project_next_batch(Layer<T> *next){
+
+			this->bslope.resize(this->bv.get_rows(), this->n, this->zero);
+			
+			vector<T> c = {this->config[0]};
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				
+				T *x = this->bv.line(b), *y = next->bv.line(b);
+				compress::div_xp2<T>(x, this->bslope.line(b), this->n, c);
+
+				for(int32_t i=0; i<std::min(this->n, this->m); i++) y[i] = x[i];
+			}
+		}
 		
 		virtual void variables_in(ifstream &get_in){
 
@@ -93,12 +112,23 @@ template<class T> class C1dxp2Layer: public ReversibleLayer<T>{
 			this->config_out(get_out, 0);
 		}
 
-		void evaluate(vector<T> feedback){
+		void evaluate(Span<const T> feedback){
 			
 			for(int32_t i=0; i<std::min(this->n, this->m); i++){
 				this->vC[i] = this->slope[i]*feedback[i];
 			}
 		}
+
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				
+				T *x = this->bvC.line(b);
+				const T *s = this->bslope.line(b), *f = feedback.line(b);
+				
+				for(int32_t i=0; i<std::min(this->n, this->m); i++) x[i] = s[i]*f[i];
+			}
+		}
 };
 
 #endif
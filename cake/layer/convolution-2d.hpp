@@ -0,0 +1,274 @@
+#ifndef CONVOLUTION_2D_LAYER_HPP_
+#define CONVOLUTION_2D_LAYER_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+
+#include "base.hpp"
+#include "base-reversible.hpp"
+#include "../func/fft.hpp"
+
+using std::vector;
+using std::ifstream;
+
+const int32_t CONVOLUTION_2D_LAYER_ID = 0x0032;
+
+template<class T> class Convolution2DLayer: public ReversibleLayer<T>{
+
+	protected:
+
+		FFT<T> *fft;
+
+		// the input is a height x width image, row after row,
+		// the kernel kh x kw. The output is the (height-kh+1) x
+		// (width-kw+1) part of the convolution where the kernel
+		// is completely inside the image.
+		int32_t height = 0, width = 0, kh = 0, kw = 0;
+
+		// the transforms are P x Q, see connect_next.
+		int32_t P = 0, Q = 0;
+
+		vector<T> kn, knC;
+
+		// the 2D FFT of kn, anything that writes kn must
+		// set spectrum_ready = 0, as in ConvolutionLayer.
+		vector<complex<T> > kn_spectrum;
+		bool spectrum_ready = 0;
+
+		// work buffers, nothing is allocated once they're made.
+		vector<complex<T> > work_spectrum, feedback_spectrum;
+		vector<T> work;
+
+		bool is_first_layer = 0;
+
+		int32_t out_height() const { return this->height-this->kh+1; }
+		int32_t out_width() const { return this->width-this->kw+1; }
+
+	public:
+
+		/*
+		   ConvolutionLayer, but the input is taken to be an image
+		   and the kernel is a small image too, so a 784 long input
+		   is convolved as the 28 x 28 picture it really is, not as
+		   one long line where the pixels above & below are 28 apart.
+
+		   The brute force version:
+
+		   for(int i=0; i<oh; i++){
+				for(int j=0; j<ow; j++){
+					for(int a=0; a<kh; a++){
+						for(int b=0; b<kw; b++){
+							out[i][j] += kn[a][b]*v[i+kh-1-a][j+kw-1-b];
+						}
+					}
+				}
+		   }
+
+		   The 2D FFTs are done row-column (FFT::rfft2), the full
+		   convolution is (height+kh-1) x (width+kw-1) and the output
+		   is the block of it starting from (kh-1, kw-1). The output
+		   is oh*ow values, m of them go to the next layer (the rest
+		   are zeros if m is larger).
+		*/
+
+		Convolution2DLayer(){ this->id = CONVOLUTION_2D_LAYER_ID; }
+
+		Convolution2DLayer(int32_t height_, int32_t width_, int32_t kh_, int32_t kw_, FFT<T> *fft_,
+				T zero_ = (T)0, bool ifl_ = 0) : ReversibleLayer<T>(height_*width_, zero_){
+			this->id = CONVOLUTION_2D_LAYER_ID;
+			this->fft = fft_;
+			this->height = height_;
+			this->width = width_;
+			this->kh = kh_;
+			this->kw = kw_;
+			this->is_first_layer = ifl_;
+
+			this->init_config();
+		}
+
+		Convolution2DLayer(ifstream &get_in, FFT<T> *fft_){
+			this->fft = fft_;
+			this->variables_in(get_in);
+		}
+
+		~Convolution2DLayer(){}
+
+		void init_config(){
+			this->configClar = {"convolution_change_speed:"};
+			this->config = {(T)0.01};
+		}
+
+		void connect_next(int32_t m_){
+			this->m = m_;
+
+			// large enough that the parts of the circular
+			// convolutions that are used don't wrap around.
+			this->P = this->fft->fft_size(this->height+this->kh-1);
+			this->Q = this->fft->transform_size(this->width+this->kw-1);
+			this->fft->fixed(this->P);
+			this->fft->fixed(this->Q/2);
+
+			int32_t bins = this->P*(this->Q/2+1);
+
+			this->kn.resize(this->kh*this->kw, this->zero);
+			this->knC.resize(this->kh*this->kw, this->zero);
+			this->spectrum_ready = 0;
+			this->work_spectrum.resize(bins);
+			this->feedback_spectrum.resize(bins);
+			this->work.resize(std::max(this->out_height()*this->out_width(), this->kh*this->kw), this->zero);
+		}
+
+		const vector<complex<T> > &filter_spectrum(){
+			if(!this->spectrum_ready){
+				this->kn_spectrum.resize(this->P*(this->Q/2+1));
+				this->fft->rfft2(this->kn, this->kh, this->kw, this->P, this->Q, this->kn_spectrum.data());
+				this->spectrum_ready = 1;
+			}
+			return this->kn_spectrum;
+		}
+
+		// out = the first out.size() outputs for the image in.
+		void convolve(Span<const T> in, Span<T> out){
+
+			const vector<complex<T> > &ks = this->filter_spectrum();
+			complex<T> *s = this->work_spectrum.data();
+
+			this->fft->rfft2(in, this->height, this->width, this->P, this->Q, s);
+			for(int32_t i=0; i<(int32_t)ks.size(); i++) s[i] *= ks[i];
+
+			int32_t count = this->out_height()*this->out_width();
+			this->fft->irfft2(s, this->P, this->Q, Span<T>(this->work.data(), count),
+				this->kh-1, this->out_height(), this->kw-1, this->out_width());
+
+			int32_t used = std::min<int32_t>(count, out.size());
+			std::copy(this->work.begin(), this->work.begin()+used, out.begin());
+			std::fill(out.begin()+used, out.end(), this->zero);
+		}
+
+		void project_next(Layer<T> *next){
+			this->convolve(this->v, Span<T>(next->v.data(), this->m));
+		}
+
+		void project_next_batch(Layer<T> *next){
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				this->convolve(Span<const T>(this->bv.line(b), this->n), Span<T>(next->bv.line(b), this->m));
+			}
+		}
+
+		void variables_in(ifstream &get_in){
+
+			get_in >> this->id >> this->n >> this->m >> this->zero;
+			get_in >> this->height >> this->width >> this->kh >> this->kw;
+
+			if(!get_in.good()) return;
+
+			this->v.resize(this->n, this->zero);
+			this->vC.resize(this->n, this->zero);
+			this->connect_next(this->m);
+
+			this->config_in(get_in);
+
+			for(int32_t i=0; i<this->kh*this->kw; i++) get_in >> this->kn[i];
+			this->spectrum_ready = 0;
+		}
+
+		void variables_out(ofstream &get_out){
+
+			get_out << this->id << ' ' << this->id << '\n';
+			get_out << this->n << ' ' << this->m << ' ' << this->zero << '\n';
+			get_out << this->height << ' ' << this->width << ' ' << this->kh << ' ' << this->kw << '\n';
+
+			this->config_out(get_out, 0);
+
+			for(int32_t i=0; i<this->kh*this->kw; i++) get_out << this->kn[i] << ' ';
+			get_out << '\n';
+		}
+
+		Convolution2DLayer<T> *clone(){
+			return new Convolution2DLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			this->kn = static_cast<Convolution2DLayer<T>*>(other)->kn;
+			this->spectrum_ready = 0;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			Convolution2DLayer<T> *o = static_cast<Convolution2DLayer<T>*>(other);
+			for(int32_t i=0; i<(int32_t)this->knC.size(); i++) this->knC[i] += o->knC[i];
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			Convolution2DLayer<T> *t = static_cast<Convolution2DLayer<T>*>(target);
+			for(int32_t i=0; i<this->kh*this->kw; i++) t->kn[i] += this->knC[i]*this->config[0];
+			t->spectrum_ready = 0;
+		}
+
+		void set_variables(T val){
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->kn[i] = val;
+			this->spectrum_ready = 0;
+		}
+
+		void random_variables(T (*random_func)(void)){
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->kn[i] = random_func();
+			this->spectrum_ready = 0;
+		}
+
+		void downscale_changes(T down){
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->knC[i] /= down;
+		}
+
+		void zero_changes(){
+			for(T &i : this->vC) i = this->zero;
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->knC[i] = this->zero;
+		}
+
+		void evaluate(Span<const T> feedback){
+
+			/*
+			   With g the feedback as an oh x ow image, the same
+			   sums as in ConvolutionLayer, one dimension more:
+
+			   knC[a][b] += sum_ij g[i][j]*v[i+kh-1-a][j+kw-1-b]
+			   vC[x][y] = sum_ij g[i][j]*kn[i+kh-1-x][j+kw-1-y]
+
+			   These are the convolutions of g with v flipped (from
+			   (oh-1, ow-1) on) and with kn flipped (from (0, 0) on).
+			   Neither of those parts wraps around at P x Q.
+			*/
+
+			this->set_vector_changes(this->zero);
+
+			if(this->config[0] == (T)0.0) return;
+
+			int32_t oh = this->out_height(), ow = this->out_width(), count = oh*ow;
+			int32_t used = std::min<int32_t>(count, this->m);
+			complex<T> *g = this->feedback_spectrum.data(), *s = this->work_spectrum.data();
+			int32_t bins = this->feedback_spectrum.size();
+
+			std::copy(feedback.begin(), feedback.begin()+used, this->work.begin());
+			std::fill(this->work.begin()+used, this->work.begin()+count, this->zero);
+			this->fft->rfft2(Span<const T>(this->work.data(), count), oh, ow, this->P, this->Q, g);
+
+			this->fft->rfft2(this->v, this->height, this->width, this->P, this->Q, s, 1);
+			for(int32_t i=0; i<bins; i++) s[i] *= g[i];
+			this->fft->irfft2(s, this->P, this->Q, Span<T>(this->work.data(), this->kh*this->kw),
+				oh-1, this->kh, ow-1, this->kw);
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->knC[i] += this->work[i];
+
+			if(!this->is_first_layer){
+				this->fft->rfft2(this->kn, this->kh, this->kw, this->P, this->Q, s, 1);
+				for(int32_t i=0; i<bins; i++) s[i] *= g[i];
+				this->fft->irfft2(s, this->P, this->Q, this->vC, 0, this->height, 0, this->width);
+			}
+		}
+
+		void adjust(){
+			for(int32_t i=0; i<this->kh*this->kw; i++) this->kn[i] += this->knC[i]*this->config[0];
+			this->spectrum_ready = 0;
+		}
+};
+
+#endif
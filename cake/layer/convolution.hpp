@@ -22,6 +22,20 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 		FFT<T> *fft;
 
 		vector<T> cn, cnC;
+
+		// the FFT of cn, made again on the next projection
+		// whenever cn changes. Anything that writes cn must
+		// set spectrum_ready = 0.
+		vector<complex<T> > cn_spectrum;
+		bool spectrum_ready = 0;
+
+		// see use_input_spectra, input_spectrum is a work buffer.
+		const SpectrumCache<T> *input_cache = NULL;
+		vector<int32_t> input_samples;
+		vector<complex<T> > input_spectrum;
+
+		// the result of a convolution in evaluate, before it's added to cnC.
+		vector<T> work;
 		
 		// since the convolution operation is rather heavy,
 		// the evaluation operations are cutting off if they
@@ -96,15 +110,73 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 		void connect_next(int32_t m_){
 			this->m = m_;
 			this->cn.resize(this->n+this->m-1, this->zero);
+			this->spectrum_ready = 0;
 			this->cnC.resize(this->n+this->m-1, this->zero);
+			this->work.resize(this->n+this->m-1, this->zero);
+			this->fft->reserve(this->n+this->m-1);
+			this->fft->fixed(this->fft->transform_size(this->n+this->m-1)/2);
 		}
 		
+		const vector<complex<T> > &filter_spectrum(){
+			if(!this->spectrum_ready){
+				this->fft->spectrum(this->cn, this->n+this->m-1, this->cn_spectrum);
+				this->spectrum_ready = 1;
+			}
+			return this->cn_spectrum;
+		}
+
+		int32_t input_transform_size(){
+			return this->fft->transform_size(this->n+this->m-1);
+		}
+
+		void use_input_spectra(const SpectrumCache<T> *cache, Span<const int32_t> samples){
+
+			this->input_cache = NULL;
+			this->input_samples.clear();
+
+			if(cache == NULL || cache->empty()) return;
+			if(cache->transform_size() != this->input_transform_size() || cache->sample_length() != this->n) return;
+
+			this->input_cache = cache;
+			this->input_samples.assign(samples.begin(), samples.end());
+			this->input_spectrum.resize(cache->transform_size()/2+1);
+		}
+
+		// puts the cached spectrum of batch row b in input_spectrum, if there is one.
+		bool cached_input(int32_t b){
+			if(this->input_cache == NULL || b >= (int32_t)this->input_samples.size()) return 0;
+			this->input_cache->get(this->input_samples[b], this->input_spectrum.data());
+			return 1;
+		}
+
 		void project_next(Layer<T> *next){
 			
-			vector<T> conv = this->fft->convolution(this->v, this->cn, this->n+this->m-1);
-			for(int32_t i=0; i<this->m; i++) next->v[i] = conv[i+this->n-1];
+			this->fft->spectrum_convolution(this->v, this->filter_spectrum(), this->n+this->m-1,
+				Span<T>(next->v.data(), this->m), this->n-1);
 			
 		}
+
+		void project_next_batch(Layer<T> *next){
+
+			if(this->input_cache == NULL){
+				// the whole batch through the batched FFTs at once.
+				this->fft->spectrum_convolution_batch(this->bv.line(0), this->n, this->bv.stride(), this->bv.get_rows(),
+					this->filter_spectrum(), this->n+this->m-1, next->bv.line(0), this->m, next->bv.stride(), this->n-1);
+				return;
+			}
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				
+				Span<T> out(next->bv.line(b), this->m);
+				if(this->cached_input(b)){
+					this->fft->spectra_convolution(this->input_spectrum.data(), this->filter_spectrum(),
+						this->input_transform_size(), out, this->n-1);
+				} else {
+					this->fft->spectrum_convolution(Span<const T>(this->bv.line(b), this->n), this->filter_spectrum(),
+						this->n+this->m-1, out, this->n-1);
+				}
+			}
+		}
 		
 		void variables_in(ifstream &get_in){
 			
@@ -119,6 +191,7 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 			this->config_in(get_in);
 			
 			for(int32_t i=0; i<this->n+this->m-1; i++) get_in >> this->cn[i];
+			this->spectrum_ready = 0;
 		}
 
 		void variables_out(ofstream &get_out){
@@ -132,12 +205,35 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 			get_out << '\n';
 		}
 
+		ConvolutionLayer<T> *clone(){
+			return new ConvolutionLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			this->cn = static_cast<ConvolutionLayer<T>*>(other)->cn;
+			this->spectrum_ready = 0;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			ConvolutionLayer<T> *o = static_cast<ConvolutionLayer<T>*>(other);
+			for(int32_t i=0; i<(int32_t)this->cnC.size(); i++) this->cnC[i] += o->cnC[i];
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			ConvolutionLayer<T> *t = static_cast<ConvolutionLayer<T>*>(target);
+			for(int32_t i=0; i<this->n+this->m-1; i++) t->cn[i] += this->cnC[i]*this->config[0];
+			t->spectrum_ready = 0;
+		}
+
 		void set_variables(T val){
 			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] = val;
+			this->spectrum_ready = 0;
 		}
 		
 		void random_variables(T (*random_func)(void)){
 			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] = random_func();
+			this->spectrum_ready = 0;
 		}
 
 		void downscale_changes(T down){
@@ -149,7 +245,21 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] = this->zero;
 		}
 
-		void evaluate(vector<T> &feedback){
+		void evaluate(Span<const T> feedback){
+			this->evaluate_row(feedback, 0);
+		}
+
+		// evaluate_batch with the cached input spectra when there are some.
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				std::copy(this->bv.line(b), this->bv.line(b)+this->n, this->v.begin());
+				this->evaluate_row(Span<const T>(feedback.line(b), this->m), this->cached_input(b));
+				std::copy(this->vC.begin(), this->vC.end(), this->bvC.line(b));
+			}
+		}
+
+		// input_cached: input_spectrum holds the spectrum of v.
+		void evaluate_row(Span<const T> feedback, bool input_cached){
 			
 			/*
 			   The logic here is the exact same as in the matrix layer.
@@ -172,19 +282,28 @@ template<class T> class ConvolutionLayer: public ReversibleLayer<T>{
 			*/
 
 			// optimization for cases when convolution doesn't change
-			if(this->cn_speed == (T)0.0) return;
+			this->set_vector_changes(this->zero);
 
-			vector<T> ccnC = this->fft->convolution(this->v, feedback, this->n+this->m-1, 1, 0);
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] += ccnC[i];
+			if(this->config[0] == (T)0.0) return;
+
+			if(input_cached){
+				this->fft->flip_spectrum(this->input_spectrum.data(), this->n, this->input_transform_size());
+				this->fft->spectrum_convolution(feedback, this->input_spectrum, this->n+this->m-1, this->work);
+			} else {
+				this->fft->convolution(this->v, feedback, this->n+this->m-1, this->work, 0, 1, 0);
+			}
+			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] += this->work[i];
 			
 			if(!this->is_first_layer){
-				vector<T> cvC = this->fft->convolution(this->cn, feedback, this->n+this->m-1, 1, 0);
-				for(int32_t i=0; i<this->n; i++) this->vC[i] += cvC[i+this->m-1];
+				this->fft->convolution(this->cn, feedback, this->n+this->m-1,
+					Span<T>(this->work.data(), this->n), this->m-1, 1, 0);
+				for(int32_t i=0; i<this->n; i++) this->vC[i] += this->work[i];
 			}
 		}
 
 		void adjust(){
 			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] += this->cnC[i]*this->config[0];
+			this->spectrum_ready = 0;
 		}	
 };
 
@@ -0,0 +1,566 @@
+#ifndef LOCAL_CONVOLUTION_LAYER_HPP_
+#define LOCAL_CONVOLUTION_LAYER_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "base.hpp"
+#include "base-reversible.hpp"
+#include "../func/dense-matrix.hpp"
+#include "../func/gemm.hpp"
+#include "../func/kernels.hpp"
+
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+
+const int32_t LOCAL_CONVOLUTION_LAYER_ID = 0x0033;
+
+// the samples of a batch are im2col'd & multiplied this many at a time.
+const int32_t LOCAL_CONVOLUTION_GROUP = 16;
+
+template<class T> class LocalConvolutionLayer: public ReversibleLayer<T>{
+
+	protected:
+
+		// the input is height x width pixels of channels values each,
+		// pixel by pixel (value c of pixel (y, x) at (y*width+x)*channels+c).
+		// The output is the same with filters values per pixel.
+		int32_t channels = 0, height = 0, width = 0;
+		int32_t filters = 0, kh = 0, kw = 0, stride = 1;
+
+		// filter f is row f, its weight for value c of pixel
+		// (ky, kx) of the window at (ky*kw+kx)*channels+c.
+		DenseMatrix<T> kn, knC;
+
+		// im2col of a group of samples, its changes, and the
+		// output (or the feedback) of the group, pixel by pixel.
+		vector<T> col, colC, res;
+
+		// Winograd F(2x2, 3x3), see project_winograd. wu has the
+		// transformed filters, made again when kn changes (anything
+		// that writes kn must set winograd_ready = 0), wv, wm & wt
+		// are work space for one sample.
+		bool winograd = 0, winograd_ready = 0;
+		vector<T> wu, wv, wm, wt;
+		vector<int32_t> tile_pixel;
+
+		bool is_first_layer = 0;
+
+		int32_t out_height() const { return (this->height-this->kh)/this->stride+1; }
+		int32_t out_width() const { return (this->width-this->kw)/this->stride+1; }
+		int32_t positions() const { return this->out_height()*this->out_width(); }
+		int32_t taps() const { return this->kh*this->kw*this->channels; }
+
+		bool winograd_fits() const { return this->kh == 3 && this->kw == 3 && this->stride == 1; }
+
+		// the transforms cost about as much as the products they save
+		// with few channels, only from about 8 on does Winograd win.
+		bool winograd_pays() const { return this->winograd_fits() && this->channels >= 8; }
+
+		// the 2x2 output blocks of Winograd.
+		int32_t tiles() const { return ((this->out_height()+1)/2)*((this->out_width()+1)/2); }
+
+	public:
+
+		/*
+		   A convolution with a small kernel: each output pixel
+		   only sees the kh x kw window of input pixels under it,
+		   not the whole input like ConvolutionLayer. There are
+		   filters kernels, each makes one output channel, and the
+		   window moves stride pixels at a time. No padding, the
+		   windows stay inside the image, the output is
+		   ((height-kh)/stride+1) x ((width-kw)/stride+1) pixels.
+
+		   The brute force version:
+
+		   for(int y=0; y<oh; y++){
+				for(int x=0; x<ow; x++){
+					for(int f=0; f<filters; f++){
+						for(int k=0; k<kh*kw*channels; k++){
+							out[y][x][f] += kn[f][k]*window(y, x)[k];
+						}
+					}
+				}
+		   }
+
+		   which is a matrix product once the windows are copied
+		   out into the rows of a matrix (im2col): out = col * kn^T.
+		   The training sums are products of the same matrices.
+		   With 5x5 kernels on a 28x28 image that's 25 multiplies
+		   per output instead of the 1568 point FFTs of the
+		   full length convolution layers.
+
+		   3x3 kernels with stride 1 and enough channels go forward
+		   with Winograd's F(2x2, 3x3) instead, see project_winograd
+		   (set_winograd turns it on or off by hand).
+
+		   m is taken to be oh*ow*filters, a smaller m gets the
+		   first m outputs and a larger one zeros after them.
+		*/
+
+		LocalConvolutionLayer(){ this->id = LOCAL_CONVOLUTION_LAYER_ID; }
+
+		LocalConvolutionLayer(
+				int32_t channels_, int32_t height_, int32_t width_,
+				int32_t filters_, int32_t kh_, int32_t kw_, int32_t stride_ = 1,
+				T zero_ = (T)0, bool ifl_ = 0) : ReversibleLayer<T>(channels_*height_*width_, zero_){
+			this->id = LOCAL_CONVOLUTION_LAYER_ID;
+			this->channels = channels_;
+			this->height = height_;
+			this->width = width_;
+			this->filters = filters_;
+			this->kh = kh_;
+			this->kw = kw_;
+			this->stride = stride_;
+			this->is_first_layer = ifl_;
+			this->winograd = this->winograd_pays();
+
+			this->init_config();
+		}
+
+		LocalConvolutionLayer(ifstream &get_in){
+			this->variables_in(get_in);
+		}
+
+		~LocalConvolutionLayer(){}
+
+		void init_config(){
+			this->configClar = {"convolution_change_speed:"};
+			this->config = {(T)0.01};
+		}
+
+		void connect_next(int32_t m_){
+			this->m = m_;
+
+			int32_t P = this->positions(), K = this->taps(), F = this->filters;
+			int32_t G = LOCAL_CONVOLUTION_GROUP;
+
+			this->kn.resize(F, K, this->zero);
+			this->knC.resize(F, K, this->zero);
+			this->col.resize((size_t)G*P*K);
+			this->colC.resize((size_t)G*P*K);
+			this->res.resize((size_t)G*P*F);
+
+			this->winograd_ready = 0;
+			if(this->winograd_fits()){
+				this->wu.resize((size_t)16*F*this->channels);
+				int32_t NT = this->tiles(), tx = (this->out_width()+1)/2;
+				this->wv.resize((size_t)16*NT*this->channels);
+				this->wm.resize((size_t)16*NT*F);
+				this->wt.resize(std::max((size_t)32*NT*this->channels, (size_t)12*NT*F));
+
+				// pixel k of the 4x4 block of tile t, -1 over the edge.
+				this->tile_pixel.resize(16*NT);
+				for(int32_t t=0; t<NT; t++){
+					int32_t y0 = t/tx*2, x0 = t%tx*2;
+					for(int32_t k=0; k<16; k++){
+						int32_t y = y0+k/4, x = x0+k%4;
+						this->tile_pixel[k*NT+t] = y < this->height && x < this->width ? y*this->width+x : -1;
+					}
+				}
+			}
+		}
+
+		// Winograd is only used for 3x3 kernels with stride 1.
+		void set_winograd(bool on){
+			this->winograd = on && this->winograd_fits();
+		}
+
+		bool uses_winograd() const { return this->winograd; }
+
+		// 0 is im2col, 1 Winograd when the kernel fits it.
+		int32_t implementations(){ return this->winograd_fits() ? 2 : 1; }
+
+		int32_t implementation(){ return this->winograd; }
+
+		void use_implementation(int32_t k){
+			this->set_winograd(k == 1);
+		}
+
+		string shape_key(){
+			std::ostringstream key;
+			key << this->id << ' ' << this->channels << ' ' << this->height << ' ' << this->width << ' '
+				<< this->filters << ' ' << this->kh << ' ' << this->kw << ' ' << this->stride << ' ' << this->m;
+			return key.str();
+		}
+
+		// the windows of one sample, one per row of out (positions x taps).
+		void im2col(const T *in, T *out){
+
+			int32_t C = this->channels, run = this->kw*C;
+
+			for(int32_t y=0; y<this->out_height(); y++){
+				for(int32_t x=0; x<this->out_width(); x++){
+					for(int32_t ky=0; ky<this->kh; ky++){
+						const T *from = in+((size_t)(y*this->stride+ky)*this->width+x*this->stride)*C;
+						std::copy(from, from+run, out);
+						out += run;
+					}
+				}
+			}
+		}
+
+		// adds the windows back to where im2col took them from.
+		void col2im(const T *in, T *out){
+
+			int32_t C = this->channels, run = this->kw*C;
+
+			for(int32_t y=0; y<this->out_height(); y++){
+				for(int32_t x=0; x<this->out_width(); x++){
+					for(int32_t ky=0; ky<this->kh; ky++){
+						T *to = out+((size_t)(y*this->stride+ky)*this->width+x*this->stride)*C;
+						for(int32_t i=0; i<run; i++) to[i] += in[i];
+						in += run;
+					}
+				}
+			}
+		}
+
+		/*
+		   The outputs of count samples, sample b from in+b*in_stride,
+		   its len outputs to out+b*out_stride.
+		*/
+		void project(const T *in, size_t in_stride, int32_t count, T *out, size_t out_stride, int32_t len){
+
+			if(this->winograd){
+				this->project_winograd(in, in_stride, count, out, out_stride, len);
+				return;
+			}
+
+			int32_t P = this->positions(), K = this->taps(), F = this->filters;
+			int32_t used = std::min(len, P*F);
+
+			for(int32_t first=0; first<count; first+=LOCAL_CONVOLUTION_GROUP){
+
+				int32_t group = std::min(LOCAL_CONVOLUTION_GROUP, count-first);
+
+				for(int32_t b=0; b<group; b++) this->im2col(in+(first+b)*in_stride, this->col.data()+(size_t)b*P*K);
+
+				gemm::gemm<T>(gemm::NO_TRANS, gemm::TRANS, group*P, F, K,
+					(T)1, this->col.data(), K, this->kn.line(0), this->kn.stride(),
+					(T)0, this->res.data(), F);
+
+				for(int32_t b=0; b<group; b++){
+					const T *r = this->res.data()+(size_t)b*P*F;
+					T *o = out+(first+b)*out_stride;
+					std::copy(r, r+used, o);
+					std::fill(o+used, o+len, this->zero);
+				}
+			}
+		}
+
+		/*
+		   Winograd's F(2x2, 3x3): a 2x2 block of outputs of a 3x3
+		   filter g from the 4x4 block of input d under it, with
+
+		   Y = A^T [(G g G^T) . (B^T d B)] A
+
+		   (. multiplies element by element) where
+
+		   B^T = | 1  0 -1  0 |   G = | 1    0    0   |   A^T = | 1  1  1  0 |
+		         | 0  1  1  0 |       | 1/2  1/2  1/2 |         | 0  1 -1 -1 |
+		         | 0 -1  1  0 |       | 1/2 -1/2  1/2 |
+		         | 0  1  0 -1 |       | 0    0    1   |
+
+		   16 multiplies per channel for 4 outputs instead of 36.
+		   The transforms of the filters (U = G g G^T) are made once.
+		   The 4x4 blocks (tiles) of a sample are transformed all at
+		   once, value xi of V = B^T d B is a tiles x channels matrix,
+		   and the sums over the channels are 16 matrix products,
+		   M[xi] (tiles x filters) = V[xi] (tiles x channels) *
+		   U[xi] (channels x filters). The outputs come from M the
+		   same way as V from d. Tiles over the edge of an odd sized
+		   output are padded with zeros.
+
+		   The transforms are adds, one per value per channel for V
+		   and ~9 per output per filter for Y, so this only wins
+		   when there are enough channels for the multiplies to
+		   matter, see the constructor.
+		*/
+		void project_winograd(const T *in, size_t in_stride, int32_t count, T *out, size_t out_stride, int32_t len){
+
+			int32_t C = this->channels, F = this->filters;
+			int32_t oh = this->out_height(), ow = this->out_width(), P = oh*ow;
+			int32_t tx = (ow+1)/2, NT = this->tiles();
+			int32_t used = std::min(len, P*F);
+
+			this->winograd_filters();
+
+			// value xi of every tile, for all channels (filters), is one
+			// NT x C (NT x F) matrix, so each step of the transforms
+			// is a few long vector operations.
+			size_t TC = (size_t)NT*C, TF = (size_t)NT*F;
+			T *d = this->wt.data(), *e = d+16*TC;
+			T *v = this->wv.data(), *mm = this->wm.data();
+
+			for(int32_t b=0; b<count; b++){
+
+				const T *img = in+b*in_stride;
+				T *r = this->res.data();
+
+				for(int32_t k=0; k<16; k++){
+					for(int32_t t=0; t<NT; t++){
+						int32_t pixel = this->tile_pixel[k*NT+t];
+						T *to = d+k*TC+(size_t)t*C;
+						if(pixel < 0) std::fill(to, to+C, (T)0);
+						else std::copy(img+(size_t)pixel*C, img+(size_t)(pixel+1)*C, to);
+					}
+				}
+
+				// B^T d, a row of 4 at a time, then times B.
+				for(int32_t j=0; j<4; j++){
+					combine(e+j*TC, d+j*TC, d+(8+j)*TC, (T)-1, TC);
+					combine(e+(4+j)*TC, d+(4+j)*TC, d+(8+j)*TC, (T)1, TC);
+					combine(e+(8+j)*TC, d+(8+j)*TC, d+(4+j)*TC, (T)-1, TC);
+					combine(e+(12+j)*TC, d+(4+j)*TC, d+(12+j)*TC, (T)-1, TC);
+				}
+				for(int32_t i=0; i<4; i++){
+					const T *row = e+i*4*TC;
+					T *vi = v+i*4*TC;
+					combine(vi, row, row+2*TC, (T)-1, TC);
+					combine(vi+TC, row+TC, row+2*TC, (T)1, TC);
+					combine(vi+2*TC, row+2*TC, row+TC, (T)-1, TC);
+					combine(vi+3*TC, row+TC, row+3*TC, (T)-1, TC);
+				}
+
+				for(int32_t xi=0; xi<16; xi++){
+					gemm::gemm<T>(gemm::NO_TRANS, gemm::NO_TRANS, NT, F, C,
+						(T)1, v+xi*TC, C, this->wu.data()+(size_t)xi*C*F, F,
+						(T)0, mm+xi*TF, F);
+				}
+
+				// A^T M: s = rows 0+1+2, u = rows 1-2-3, then the same on the columns.
+				T *sr = d, *ur = d+4*TF, *y = d+8*TF;
+				for(int32_t j=0; j<4; j++){
+					combine(sr+j*TF, mm+j*TF, mm+(4+j)*TF, (T)1, TF);
+					kernels::axpy<T>(TF, (T)1, mm+(8+j)*TF, sr+j*TF);
+					combine(ur+j*TF, mm+(4+j)*TF, mm+(8+j)*TF, (T)-1, TF);
+					kernels::axpy<T>(TF, (T)-1, mm+(12+j)*TF, ur+j*TF);
+				}
+				for(int32_t i=0; i<2; i++){
+					const T *row = i ? ur : sr;
+					combine(y+2*i*TF, row, row+TF, (T)1, TF);
+					kernels::axpy<T>(TF, (T)1, row+2*TF, y+2*i*TF);
+					combine(y+(2*i+1)*TF, row+TF, row+2*TF, (T)-1, TF);
+					kernels::axpy<T>(TF, (T)-1, row+3*TF, y+(2*i+1)*TF);
+				}
+
+				for(int32_t t=0; t<NT; t++){
+					int32_t y0 = t/tx*2, x0 = t%tx*2;
+					for(int32_t i=0; i<2 && y0+i<oh; i++){
+						for(int32_t j=0; j<2 && x0+j<ow; j++){
+							const T *from = y+(2*i+j)*TF+(size_t)t*F;
+							std::copy(from, from+F, r+((size_t)(y0+i)*ow+x0+j)*F);
+						}
+					}
+				}
+
+				T *o = out+b*out_stride;
+				std::copy(r, r+used, o);
+				std::fill(o+used, o+len, this->zero);
+			}
+		}
+
+		// out = x + a*y, n long.
+		static void combine(T *out, const T *x, const T *y, T a, int32_t n){
+			std::copy(x, x+n, out);
+			kernels::axpy<T>(n, a, y, out);
+		}
+
+		// U = G g G^T for every filter & channel, U[xi] is a channels x filters matrix.
+		void winograd_filters(){
+
+			if(this->winograd_ready) return;
+
+			int32_t C = this->channels, F = this->filters;
+
+			for(int32_t f=0; f<F; f++){
+				for(int32_t c=0; c<C; c++){
+					T g[9], u[16];
+					for(int32_t k=0; k<9; k++) g[k] = this->kn(f, k*C+c);
+					winograd_filter(g, u);
+					for(int32_t xi=0; xi<16; xi++) this->wu[((size_t)xi*C+c)*F+f] = u[xi];
+				}
+			}
+			this->winograd_ready = 1;
+		}
+
+		static void winograd_filter(const T *g, T *u){
+			// G g (4x3), then times G^T.
+			T t[12];
+			for(int32_t j=0; j<3; j++){
+				t[j] = g[j];
+				t[3+j] = (g[j]+g[3+j]+g[6+j])*(T)0.5;
+				t[6+j] = (g[j]-g[3+j]+g[6+j])*(T)0.5;
+				t[9+j] = g[6+j];
+			}
+			for(int32_t i=0; i<4; i++){
+				const T *r = t+i*3;
+				u[i*4] = r[0];
+				u[i*4+1] = (r[0]+r[1]+r[2])*(T)0.5;
+				u[i*4+2] = (r[0]-r[1]+r[2])*(T)0.5;
+				u[i*4+3] = r[2];
+			}
+		}
+
+		void project_next(Layer<T> *next){
+			this->project(this->v.data(), this->n, 1, next->v.data(), this->m, this->m);
+		}
+
+		void project_next_batch(Layer<T> *next){
+			this->project(this->bv.line(0), this->bv.stride(), this->bv.get_rows(),
+				next->bv.line(0), next->bv.stride(), this->m);
+		}
+
+		/*
+		   The training sums for count samples, with g the feedback
+		   of a group as a matrix (one output pixel per row):
+
+		   knC += g^T * col
+		   changes of the inputs = col2im(g * kn)
+
+		   changes+b*changes_stride must be zeros beforehand.
+		*/
+		void backward(
+				const T *in, size_t in_stride, const T *feedback, size_t feedback_stride, int32_t len,
+				int32_t count, T *changes, size_t changes_stride){
+
+			int32_t P = this->positions(), K = this->taps(), F = this->filters;
+			int32_t used = std::min(len, P*F);
+
+			for(int32_t first=0; first<count; first+=LOCAL_CONVOLUTION_GROUP){
+
+				int32_t group = std::min(LOCAL_CONVOLUTION_GROUP, count-first);
+
+				for(int32_t b=0; b<group; b++){
+					this->im2col(in+(first+b)*in_stride, this->col.data()+(size_t)b*P*K);
+					const T *g = feedback+(first+b)*feedback_stride;
+					T *r = this->res.data()+(size_t)b*P*F;
+					std::copy(g, g+used, r);
+					std::fill(r+used, r+P*F, (T)0);
+				}
+
+				gemm::gemm<T>(gemm::TRANS, gemm::NO_TRANS, F, K, group*P,
+					(T)1, this->res.data(), F, this->col.data(), K,
+					(T)1, this->knC.line(0), this->knC.stride());
+
+				if(this->is_first_layer) continue;
+
+				gemm::gemm<T>(gemm::NO_TRANS, gemm::NO_TRANS, group*P, K, F,
+					(T)1, this->res.data(), F, this->kn.line(0), this->kn.stride(),
+					(T)0, this->colC.data(), K);
+
+				for(int32_t b=0; b<group; b++){
+					this->col2im(this->colC.data()+(size_t)b*P*K, changes+(first+b)*changes_stride);
+				}
+			}
+		}
+
+		void variables_in(ifstream &get_in){
+
+			get_in >> this->id >> this->n >> this->m >> this->zero;
+			get_in >> this->channels >> this->height >> this->width;
+			get_in >> this->filters >> this->kh >> this->kw >> this->stride;
+
+			if(!get_in.good()) return;
+
+			this->winograd = this->winograd_pays();
+
+			this->v.resize(this->n, this->zero);
+			this->vC.resize(this->n, this->zero);
+			this->connect_next(this->m);
+
+			this->config_in(get_in);
+
+			for(int32_t i=0; i<this->filters; i++){
+				for(int32_t j=0; j<this->taps(); j++) get_in >> this->kn(i, j);
+			}
+			this->winograd_ready = 0;
+		}
+
+		void variables_out(ofstream &get_out){
+
+			get_out << this->id << ' ' << this->id << '\n';
+			get_out << this->n << ' ' << this->m << ' ' << this->zero << '\n';
+			get_out << this->channels << ' ' << this->height << ' ' << this->width << '\n';
+			get_out << this->filters << ' ' << this->kh << ' ' << this->kw << ' ' << this->stride << '\n';
+
+			this->config_out(get_out, 0);
+
+			for(int32_t i=0; i<this->filters; i++){
+				for(int32_t j=0; j<this->taps(); j++){
+					get_out << this->kn(i, j) << ' ';
+				} get_out << '\n';
+			}
+		}
+
+		LocalConvolutionLayer<T> *clone(){
+			return new LocalConvolutionLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			this->kn = static_cast<LocalConvolutionLayer<T>*>(other)->kn;
+			this->winograd_ready = 0;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			this->knC.add_scaled(static_cast<LocalConvolutionLayer<T>*>(other)->knC, (T)1);
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			LocalConvolutionLayer<T> *t = static_cast<LocalConvolutionLayer<T>*>(target);
+			t->kn.add_scaled(this->knC, this->config[0]);
+			t->winograd_ready = 0;
+		}
+
+		void set_variables(T val){
+			this->kn.fill(val);
+			this->winograd_ready = 0;
+		}
+
+		void random_variables(T (*random_func)(void)){
+			for(int32_t i=0; i<this->filters; i++){
+				for(int32_t j=0; j<this->taps(); j++) this->kn(i, j) = random_func();
+			}
+			this->winograd_ready = 0;
+		}
+
+		void downscale_changes(T down){
+			this->knC.divide(down);
+		}
+
+		void zero_changes(){
+			for(T &i : this->vC) i = this->zero;
+			this->knC.fill(this->zero);
+		}
+
+		void evaluate(Span<const T> feedback){
+
+			this->set_vector_changes(this->zero);
+
+			if(this->config[0] == (T)0.0) return;
+
+			this->backward(this->v.data(), this->n, feedback.data(), this->m, this->m, 1, this->vC.data(), this->n);
+		}
+
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			this->bvC.fill(this->zero);
+
+			if(this->config[0] == (T)0.0) return;
+
+			this->backward(this->bv.line(0), this->bv.stride(), feedback.line(0), feedback.stride(), this->m,
+				this->bv.get_rows(), this->bvC.line(0), this->bvC.stride());
+		}
+
+		void adjust(){
+			this->kn.add_scaled(this->knC, this->config[0]);
+			this->winograd_ready = 0;
+		}
+};
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "base.hpp"
 #include "base-reversible.hpp"
+#include "../func/dense-matrix.hpp"
 
 using std::vector;
 using std::ifstream;
@@ -18,7 +19,7 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 	
 	protected:
 
-		vector<vector<T> > mx, mxC;
+		DenseMatrix<T> mx, mxC;
 
 	public:
 
@@ -26,14 +27,17 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 		   
 		   The data is shuffled with a matrix on to the next layer.
 		   Each node i from this layer effects each node j in the
-		   next layer with some coefficient mx[i][j].
+		   next layer with some coefficient mx(i, j).
+
+		   The matrix is stored row-major by default, see
+		   set_matrix_layout and func/dense-matrix.
 
 		*/
 
 		MatrixLayer(){ this->id = MATRIX_LAYER_ID; }
 		
 		MatrixLayer(int32_t n_, int32_t m_, T zero_) : ReversibleLayer<T>(n_, m_, zero_){
-			this->connect_next();
+			this->connect_next(m_);
 			this->id = MATRIX_LAYER_ID;
 			this->init_config();
 		}
@@ -56,20 +60,27 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 
 		void connect_next(int32_t m_){
 			this->m = m_;
-			vector<T> tmp(m_, this->zero);
-			this->mx.resize(this->n, tmp);
-			this->mxC.resize(this->n, tmp);
+			this->mx.resize(this->n, m_, this->zero);
+			this->mxC.resize(this->n, m_, this->zero);
+		}
+
+		void set_matrix_layout(MatrixLayout layout){
+			this->mx.set_layout(layout);
+			this->mxC.set_layout(layout);
 		}
 		
 		void project_next(Layer<T> *next){
 			
 			next->set_vector_all(this->zero);
 			
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					next->v[j] += this->mx[i][j]*this->v[i];
-				}
-			}
+			this->mx.project(this->v.data(), next->v.data());
+		}
+
+		void project_next_batch(Layer<T> *next){
+			
+			next->bv.fill(this->zero);
+
+			this->mx.project_batch(this->bv, next->bv);
 		}
 
 		void variables_in(ifstream &get_in){
@@ -85,7 +96,7 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 			this->vC.resize(this->n, this->zero);
 			
 			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++) get_in >> this->mx[i][j];
+				for(int32_t j=0; j<this->m; j++) get_in >> this->mx(i, j);
 			}
 
 		}
@@ -99,15 +110,32 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 			
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					get_out << this->mx[i][j] << ' ';
+					get_out << this->mx(i, j) << ' ';
 				} get_out << '\n';
 			}
 		}
 
+		MatrixLayer<T> *clone(){
+			return new MatrixLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			this->mx = static_cast<MatrixLayer<T>*>(other)->mx;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			this->mxC.add_scaled(static_cast<MatrixLayer<T>*>(other)->mxC, (T)1);
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			static_cast<MatrixLayer<T>*>(target)->mx.add_scaled(this->mxC, this->config[0]);
+		}
+
 		void set_variables(T val){
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] = val;
+					this->mx(i, j) = val;
 				}
 			}
 		}
@@ -115,31 +143,23 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 		void random_variables(T (*random_func)(void)){
 			for(int32_t i=0; i<this->n; i++){
 				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] = random_func();
+					this->mx(i, j) = random_func();
 				}
 			}
 		}
 
 		void downscale_changes(T down){
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] /= down;
-				}
-			}
+			this->mxC.divide(down);
 		}
 		
 		void zero_changes(){
 
 			for(T &i : this->vC) i = this->zero;
 
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] = this->zero;
-				}
-			}
+			this->mxC.fill(this->zero);
 		}
 
-		void evaluate(vector<T> feedback){
+		void evaluate(Span<const T> feedback){
 
 			/*
 			   feedback shows the desired changes to variables in the
@@ -157,20 +177,20 @@ template<class T> class MatrixLayer: public ReversibleLayer<T>{
 
 			this->set_vector_changes(this->zero);
 
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mxC[i][j] += this->v[i]*feedback[j];
-					this->vC[i] += this->mx[i][j]*feedback[j];
-				}
-			}
+			this->mxC.add_outer(this->v.data(), feedback.data());
+			this->mx.project_back(feedback.data(), this->vC.data());
+		}
+
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			this->bvC.fill(this->zero);
+
+			this->mxC.add_outer_batch(this->bv, feedback);
+			this->mx.project_back_batch(feedback, this->bvC);
 		}
 
 		void adjust(){
-			for(int32_t i=0; i<this->n; i++){
-				for(int32_t j=0; j<this->m; j++){
-					this->mx[i][j] += this->config[0]*this->mxC[i][j];
-				}
-			}
+			this->mx.add_scaled(this->mxC, this->config[0]);
 		}	
 };
 
@@ -9,12 +9,18 @@
 #include "base.hpp"
 #include "base-reversible.hpp"
 #include "../func/fft.hpp"
+#include "../func/dense-matrix.hpp"
+#include "../func/gemm.hpp"
+#include "../func/kernels.hpp"
 
 using std::vector;
 using std::ifstream;
 using std::ifstream;
 
-const int32_t SPARSE_CONVOLUTION_LAYER_ID = 0x0031;
+// saves hold all 2n-1 taps of cn. The older SPARSE_CONVOLUTION_LAYER_V1_ID
+// ones only have the first n+m-1, see variables_in.
+const int32_t SPARSE_CONVOLUTION_LAYER_ID = 0x0034;
+const int32_t SPARSE_CONVOLUTION_LAYER_V1_ID = 0x0031;
 
 template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 
@@ -25,12 +31,39 @@ template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 
 		vector<T> cn, cnC;
 
+		// the FFT of cn, made again on the next projection
+		// whenever cn changes. Anything that writes cn must
+		// set spectrum_ready = 0 (and toeplitz_ready = 0).
+		vector<complex<T> > cn_spectrum;
+		bool spectrum_ready = 0;
+
+		// see use_input_spectra, input_spectrum is a work buffer.
+		const SpectrumCache<T> *input_cache = NULL;
+		vector<int32_t> input_samples;
+		vector<complex<T> > input_spectrum;
+
+		// output j is value sample[j] of the middle n values
+		// of the convolution, see connect_next.
+		vector<int32_t> sample;
+
+		// see use_direct, toeplitz is remade like cn_spectrum
+		// and toeplitzC is work space for evaluate_batch.
+		bool direct = 0, toeplitz_ready = 0;
+		DenseMatrix<T> toeplitz, toeplitzC;
+
+		// work buffers: the middle n values of the convolution
+		// (of FFT_BATCH_GROUP samples in project_next_batch)
+		// and the feedback spread back to n values in evaluate.
+		vector<T> work, batch_work, spread;
+
 	public:
 
 		/*
 		   almost the same as ConvolutionLayer, but
 		   the convolution layer size is 2*n-1 and m values
 		   are gathered sparsely from the output convolution.
+		   Only those m are worked out, directly or through
+		   the FFTs, whichever is cheaper (see direct_pays).
 		*/
 
 		SparseConvolutionLayer(){ this->id = SPARSE_CONVOLUTION_LAYER_ID; }
@@ -68,20 +101,167 @@ template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 		void connect_next(int32_t m_){
 			this->m = m_;
 			this->cn.resize(2*this->n-1, this->zero);
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
 			this->cnC.resize(2*this->n-1, this->zero);
+			this->work.resize(2*this->n-1, this->zero);
+			this->spread.resize(this->n, this->zero);
+			this->fft->reserve(2*this->n-1);
+			this->fft->fixed(this->fft->transform_size(2*this->n-1)/2);
+
+			this->sample.resize(this->m);
+			float jump = (float)this->n/this->m, pos = 0;
+			for(int32_t i=0; i<this->m; i++){
+				this->sample[i] = (int32_t)std::floor(pos);
+				pos += jump;
+			}
+
+			this->use_direct(this->direct_pays());
+		}
+
+		/*
+		   The m outputs can be worked out two ways: the direct way
+		   is m dot products n long, n*m multiplies (one GEMM for
+		   a batch). Through the FFTs it's the middle n values of
+		   the convolution, m of them sampled, about size*log(size)
+		   work however small m is, and three transforms for the
+		   changes. Measured, the FFTs only win once n*m is over
+		   about 24 times size*log2(size) (m of about 500 for n of
+		   784), and with batches not even then, GEMM is that fast.
+		*/
+		bool direct_pays(){
+			int32_t size = this->fft->transform_size(2*this->n-1);
+			return (double)this->n*this->m < 24.0*size*std::log2((double)size);
+		}
+
+		void use_direct(bool on){
+			this->direct = on;
+			this->toeplitz_ready = 0;
+			if(on){
+				this->use_input_spectra(NULL, {});
+				this->toeplitz.resize(this->n, this->m);
+			} else {
+				this->toeplitz = DenseMatrix<T>();
+				this->toeplitzC = DenseMatrix<T>();
+			}
+		}
+
+		bool uses_direct() const { return this->direct; }
+
+		// 0 is through the FFTs, 1 direct.
+		int32_t implementations(){ return 2; }
+
+		int32_t implementation(){ return this->direct; }
+
+		void use_implementation(int32_t k){
+			if(k != this->direct) this->use_direct(k == 1);
+		}
+
+		// toeplitz(i, j) = cn[n-1+sample[j]-i], the weight of v[i] in output j.
+		const DenseMatrix<T> &filter_toeplitz(){
+			if(!this->toeplitz_ready){
+				for(int32_t i=0; i<this->n; i++){
+					const T *c = this->cn.data()+this->n-1-i;
+					T *row = this->toeplitz.line(i);
+					for(int32_t j=0; j<this->m; j++) row[j] = c[this->sample[j]];
+				}
+				this->toeplitz_ready = 1;
+			}
+			return this->toeplitz;
 		}
 		
+		const vector<complex<T> > &filter_spectrum(){
+			if(!this->spectrum_ready){
+				this->fft->spectrum(this->cn, 2*this->n-1, this->cn_spectrum);
+				this->spectrum_ready = 1;
+			}
+			return this->cn_spectrum;
+		}
+
+		// the direct way takes no input spectra, so no cache for it.
+		int32_t input_transform_size(){
+			if(this->direct) return 0;
+			return this->fft->transform_size(2*this->n-1);
+		}
+
+		void use_input_spectra(const SpectrumCache<T> *cache, Span<const int32_t> samples){
+
+			this->input_cache = NULL;
+			this->input_samples.clear();
+
+			if(this->direct || cache == NULL || cache->empty()) return;
+			if(cache->transform_size() != this->input_transform_size() || cache->sample_length() != this->n) return;
+
+			this->input_cache = cache;
+			this->input_samples.assign(samples.begin(), samples.end());
+			this->input_spectrum.resize(cache->transform_size()/2+1);
+		}
+
+		// puts the cached spectrum of batch row b in input_spectrum, if there is one.
+		bool cached_input(int32_t b){
+			if(this->input_cache == NULL || b >= (int32_t)this->input_samples.size()) return 0;
+			this->input_cache->get(this->input_samples[b], this->input_spectrum.data());
+			return 1;
+		}
+
 		void project_next(Layer<T> *next){
-			
-			vector<T> conv = this->fft->convolution(this->v, this->cn, 2*this->n-1);
-			
-			float jump = (float)this->n/this->m, pos = 0;
 
-			for(int32_t i=0; i<this->m; i++){
-				next->v[i] = conv[this->n-1+(int32_t)std::floor(pos)];
-				pos += jump;
+			if(this->direct){
+				std::fill(next->v.begin(), next->v.begin()+this->m, (T)0);
+				this->filter_toeplitz().project(this->v.data(), next->v.data());
+				return;
 			}
 			
+			Span<T> conv(this->work.data(), this->n);
+			this->fft->spectrum_convolution(this->v, this->filter_spectrum(), 2*this->n-1, conv, this->n-1);
+
+			for(int32_t i=0; i<this->m; i++) next->v[i] = conv[this->sample[i]];
+		}
+
+		void project_next_batch(Layer<T> *next){
+
+			if(this->direct){
+				next->bv.fill((T)0);
+				this->filter_toeplitz().project_batch(this->bv, next->bv);
+				return;
+			}
+
+			if(this->input_cache == NULL){
+				
+				// a group of samples at a time through the batched FFTs.
+				int32_t rows = this->bv.get_rows();
+				this->batch_work.resize((size_t)FFT_BATCH_GROUP*this->n);
+
+				for(int32_t first=0; first<rows; first+=FFT_BATCH_GROUP){
+
+					int32_t group = std::min(FFT_BATCH_GROUP, rows-first);
+					this->fft->spectrum_convolution_batch(this->bv.line(first), this->n, this->bv.stride(), group,
+						this->filter_spectrum(), 2*this->n-1, this->batch_work.data(), this->n, this->n, this->n-1);
+
+					for(int32_t b=0; b<group; b++){
+						
+						const T *conv = this->batch_work.data()+(size_t)b*this->n;
+						T *y = next->bv.line(first+b);
+						for(int32_t i=0; i<this->m; i++) y[i] = conv[this->sample[i]];
+					}
+				}
+				return;
+			}
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				
+				Span<T> conv(this->work.data(), this->n);
+				if(this->cached_input(b)){
+					this->fft->spectra_convolution(this->input_spectrum.data(), this->filter_spectrum(),
+						this->input_transform_size(), conv, this->n-1);
+				} else {
+					this->fft->spectrum_convolution(Span<const T>(this->bv.line(b), this->n), this->filter_spectrum(),
+						2*this->n-1, conv, this->n-1);
+				}
+
+				T *y = next->bv.line(b);
+				for(int32_t i=0; i<this->m; i++) y[i] = conv[this->sample[i]];
+			}
 		}
 		
 		void variables_in(ifstream &get_in){
@@ -95,8 +275,18 @@ template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 			this->connect_next(this->m);
 			
 			this->config_in(get_in);
-			
-			for(int32_t i=0; i<this->n+this->m-1; i++) get_in >> this->cn[i];
+
+			// the taps a V1 save doesn't have stay 0, as they were when it was
+			// made (with m > n it has more, past the end of cn, those are dropped).
+			int32_t saved = this->id == SPARSE_CONVOLUTION_LAYER_V1_ID ? this->n+this->m-1 : 2*this->n-1;
+			for(int32_t i=0; i<saved; i++){
+				T tap;
+				get_in >> tap;
+				if(i < 2*this->n-1) this->cn[i] = tap;
+			}
+			this->id = SPARSE_CONVOLUTION_LAYER_ID;
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
 		}
 
 		void variables_out(ofstream &get_out){
@@ -106,28 +296,93 @@ template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 			
 			this->config_out(get_out, 0);
 			
-			for(int32_t i=0; i<this->n+this->m-1; i++) get_out << this->cn[i] << ' ';
+			for(int32_t i=0; i<2*this->n-1; i++) get_out << this->cn[i] << ' ';
 			get_out << '\n';
 		}
 
+		SparseConvolutionLayer<T> *clone(){
+			return new SparseConvolutionLayer<T>(*this);
+		}
+
+		void copy_variables(ReversibleLayer<T> *other){
+			ReversibleLayer<T>::copy_variables(other);
+			this->cn = static_cast<SparseConvolutionLayer<T>*>(other)->cn;
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
+		}
+
+		void add_changes(ReversibleLayer<T> *other){
+			SparseConvolutionLayer<T> *o = static_cast<SparseConvolutionLayer<T>*>(other);
+			for(int32_t i=0; i<(int32_t)this->cnC.size(); i++) this->cnC[i] += o->cnC[i];
+		}
+
+		void push_changes(ReversibleLayer<T> *target){
+			SparseConvolutionLayer<T> *t = static_cast<SparseConvolutionLayer<T>*>(target);
+			for(int32_t i=0; i<2*this->n-1; i++) t->cn[i] += this->cnC[i]*this->config[0];
+			t->spectrum_ready = 0;
+			t->toeplitz_ready = 0;
+		}
+
 		void set_variables(T val){
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] = val;
+			for(int32_t i=0; i<2*this->n-1; i++) this->cn[i] = val;
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
 		}
 		
 		void random_variables(T (*random_func)(void)){
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] = random_func();
+			for(int32_t i=0; i<2*this->n-1; i++) this->cn[i] = random_func();
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
 		}
 
 		void downscale_changes(T down){
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] /= down;
+			for(int32_t i=0; i<2*this->n-1; i++) this->cnC[i] /= down;
 		}
 		
 		void zero_changes(){
 			for(T &i : this->vC) i = this->zero;
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] = this->zero;
+			for(int32_t i=0; i<2*this->n-1; i++) this->cnC[i] = this->zero;
+		}
+
+		void evaluate(Span<const T> feedback){
+			this->evaluate_row(feedback, 0);
 		}
 
-		void evaluate(vector<T> &feedback){
+		// evaluate_batch with the cached input spectra when there are some.
+		void evaluate_batch(const DenseMatrix<T> &feedback){
+
+			if(this->direct){
+
+				// the two sums of evaluate_row for the whole batch at once.
+				this->bvC.fill(this->zero);
+
+				if(this->config[0] == (T)0.0) return;
+
+				int32_t rows = this->bv.get_rows();
+				this->toeplitzC.resize(this->n, this->m);
+				gemm::gemm<T>(gemm::TRANS, gemm::NO_TRANS, this->n, this->m, rows,
+					(T)1, this->bv.line(0), this->bv.stride(), feedback.line(0), feedback.stride(),
+					(T)0, this->toeplitzC.line(0), this->toeplitzC.stride());
+
+				for(int32_t i=0; i<this->n; i++){
+					T *c = this->cnC.data()+this->n-1-i;
+					const T *row = this->toeplitzC.line(i);
+					for(int32_t j=0; j<this->m; j++) c[this->sample[j]] += row[j];
+				}
+
+				if(!this->is_first_layer) this->filter_toeplitz().project_back_batch(feedback, this->bvC);
+				return;
+			}
+
+			for(int32_t b=0; b<this->bv.get_rows(); b++){
+				std::copy(this->bv.line(b), this->bv.line(b)+this->n, this->v.begin());
+				this->evaluate_row(Span<const T>(feedback.line(b), this->m), this->cached_input(b));
+				std::copy(this->vC.begin(), this->vC.end(), this->bvC.line(b));
+			}
+		}
+
+		// input_cached: input_spectrum holds the spectrum of v.
+		void evaluate_row(Span<const T> feedback, bool input_cached){
 			
 			/*
 			   The logic here is the exact same as in the matrix layer.
@@ -150,29 +405,55 @@ template<class T> class SparseConvolutionLayer: public ReversibleLayer<T>{
 
 			*/
 
-			if(this->cn_speed == (T)0.0) return;
+			/*
+			   Output j is conv[n-1+p_j] with p_j = floor(j*n/m), so
+			   the feedback is first spread back to where it came from:
+			   g[p_j] += feedback[j]. After that it's the same as
+			   the dense convolution with a full n long feedback g.
+			*/
 
-			vector<T> changes(this->n, (T)0);
-			
-			float jump = (float)this->n/this->m, pos = 0;
+			this->set_vector_changes(this->zero);
 
-			for(int32_t i=0; i<this->m; i++){
-				this->v[this->n-1+(int32_t)std::floor(pos)] = feedback[i];
-				pos += jump;
+			if(this->config[0] == (T)0.0) return;
+
+			vector<T> &changes = this->spread;
+
+			if(this->direct){
+
+				// cnC[n-1+sample[j]-i] += v[i]*feedback[j], with v
+				// flipped that's one axpy per output.
+				std::reverse_copy(this->v.begin(), this->v.begin()+this->n, changes.begin());
+				for(int32_t j=0; j<this->m; j++){
+					kernels::axpy<T>(this->n, feedback[j], changes.data(), this->cnC.data()+this->sample[j]);
+				}
+
+				if(!this->is_first_layer) this->filter_toeplitz().project_back(feedback.data(), this->vC.data());
+				return;
 			}
+
+			for(T &i : changes) i = (T)0;
+			for(int32_t i=0; i<this->m; i++) changes[this->sample[i]] += feedback[i];
 			
-			vector<T> ccnC = this->fft->convolution(this->v, changes, this->n+this->m-1, 1, 0);
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cnC[i] += ccnC[i];
+			if(input_cached){
+				this->fft->flip_spectrum(this->input_spectrum.data(), this->n, this->input_transform_size());
+				this->fft->spectrum_convolution(changes, this->input_spectrum, 2*this->n-1, this->work);
+			} else {
+				this->fft->convolution(this->v, changes, 2*this->n-1, this->work, 0, 1, 0);
+			}
+			for(int32_t i=0; i<2*this->n-1; i++) this->cnC[i] += this->work[i];
 			
 			if(!this->is_first_layer){
-				vector<T> cvC = this->fft->convolution(this->cn, changes, this->n+this->m-1, 1, 0);
-				for(int32_t i=0; i<this->n; i++) this->vC[i] += cvC[i+this->m-1];
+				this->fft->convolution(this->cn, changes, 2*this->n-1,
+					Span<T>(this->work.data(), this->n), this->n-1, 1, 0);
+				for(int32_t i=0; i<this->n; i++) this->vC[i] += this->work[i];
 			}
 			
 		}
 
 		void adjust(){
-			for(int32_t i=0; i<this->n+this->m-1; i++) this->cn[i] += this->cnC[i]*this->config[0];
+			for(int32_t i=0; i<2*this->n-1; i++) this->cn[i] += this->cnC[i]*this->config[0];
+			this->spectrum_ready = 0;
+			this->toeplitz_ready = 0;
 		}	
 };
 